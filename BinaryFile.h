@@ -1,5 +1,6 @@
 // The BinaryFile class is used to write data to and read data from a file on disk.
 // Written by Carey Nachenberg.
+// POSIX only: the file is also opened as a descriptor, for fsync() and posix_fallocate().
 
 #ifndef BINARYFILE_H_
 #define BINARYFILE_H_
@@ -9,6 +10,8 @@
 #include <string>
 #include <type_traits>
 #include <cstdint> // if Offset is int32_t instead of ios::streamoff
+#include <fcntl.h>  // open(), fsync() and posix_fallocate() on the same file
+#include <unistd.h>
 using namespace std;
 
 template<typename T> struct False : false_type {};
@@ -31,9 +34,12 @@ public:
 
 	typedef int32_t Offset;
 
+	BinaryFile()
+		: m_fd(-1) {}
+
 	~BinaryFile()
 	{
-		m_stream.close();
+		close();
 	}
 
 	bool openExisting(const std::string& filename)
@@ -41,7 +47,7 @@ public:
 		if (m_stream.is_open())
 			return false;
 		m_stream.open(filename, ios::in | ios::out | ios::binary);
-		return m_stream.good();
+		return m_stream.good() && openDescriptor(filename);
 	}
 
 	bool createNew(const std::string& filename)
@@ -49,13 +55,16 @@ public:
 		if (m_stream.is_open())
 			return false;
 		m_stream.open(filename, ios::in | ios::out | ios::binary | ios::trunc);
-		return m_stream.good();
+		return m_stream.good() && openDescriptor(filename);
 	}
 
 	void close()
 	{
 		if (m_stream.is_open())
 			m_stream.close();
+		if (m_fd >= 0)
+			::close(m_fd);
+		m_fd = -1;
 	}
 
 	template<typename T>
@@ -128,6 +137,39 @@ public:
 		return static_cast<Offset>(length);
 	}
 
+	// Grows the file to at least length bytes (the new bytes read as zeros), with
+	// disk space actually reserved for them
+	bool extend(Offset length)
+	{
+		if (fileLength() >= length)
+			return true;
+		return flush() && posix_fallocate(m_fd, 0, length) == 0;
+	}
+
+	bool flush()
+	{
+		return static_cast<bool>(m_stream.flush());
+	}
+
+	// Flushes the stream and waits until the OS has written the file to disk
+	bool sync()
+	{
+		return flush() && fsync(m_fd) == 0;
+	}
+
+	// Makes a file's creation or deletion in its directory durable
+	static bool syncDirectoryOf(const std::string& filename)
+	{
+		std::string::size_type slash = filename.rfind('/');
+		std::string directory = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+		int fd = ::open(directory.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		bool synced = fsync(fd) == 0;
+		::close(fd);
+		return synced;
+	}
+
 	bool isOpen() const
 	{
 		return m_stream.is_open();
@@ -135,6 +177,16 @@ public:
 
 private:
 	fstream m_stream;
+	int m_fd; // the same file, for sync()
+
+	bool openDescriptor(const std::string& filename)
+	{
+		m_fd = ::open(filename.c_str(), O_RDWR);
+		if (m_fd >= 0)
+			return true;
+		m_stream.close();
+		return false;
+	}
 
 	// fstreams are not copyable, so BinaryFiles won't be copyable.
 };
@@ -0,0 +1,160 @@
+#include "CountMinSketch.h"
+#include <cmath>
+#include <functional>
+using namespace std;
+
+CountMinSketch::CountMinSketch()
+	: m_dirty(false) {}
+
+CountMinSketch::~CountMinSketch()
+{
+	close();
+}
+
+bool CountMinSketch::createNew(const string& filename, unsigned int width)
+{
+	close();
+	if (!validWidth(width) || !bf.createNew(filename))
+		return false;
+	m_header = Header(width);
+	m_counters.assign(static_cast<size_t>(SKETCH_DEPTH) * width, 0);
+	m_dirty = true;
+	if (!flush())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool CountMinSketch::openExisting(const string& filename)
+{
+	close();
+	if (!bf.openExisting(filename))
+		return false;
+	if (!bf.read(m_header, 0) || m_header.m_depth != SKETCH_DEPTH || m_header.m_version != SKETCH_VERSION
+		|| !m_header.m_clean || !validWidth(m_header.m_width))
+	{
+		close();
+		return false;
+	}
+	m_counters.resize(static_cast<size_t>(SKETCH_DEPTH) * m_header.m_width);
+	if (!bf.read(reinterpret_cast<char*>(m_counters.data()), m_counters.size() * sizeof(uint32_t), sizeof(m_header)))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void CountMinSketch::close()
+{
+	if (bf.isOpen())
+		flush();
+	bf.close();
+	m_counters.clear();
+	m_dirty = false;
+}
+
+bool CountMinSketch::isOpen() const
+{
+	return bf.isOpen();
+}
+
+void CountMinSketch::add(const string& key, int count)
+{
+	if (!bf.isOpen() || count == 0)
+		return;
+	if (m_header.m_clean)
+		writeClean(false); // before the change this add() stands for can reach the disk
+
+	size_t column[SKETCH_DEPTH];
+	columns(key, column);
+	for (unsigned int row = 0; row < SKETCH_DEPTH; ++row)
+	{
+		uint32_t& counter = m_counters[row * m_header.m_width + column[row]];
+		if (count > 0)
+			counter += count;
+		else
+			counter = counter > static_cast<uint32_t>(-count) ? counter + count : 0;
+	}
+	if (count > 0)
+		m_header.m_total += count;
+	else
+		m_header.m_total = m_header.m_total > static_cast<uint64_t>(-count) ? m_header.m_total + count : 0;
+	m_dirty = true;
+}
+
+unsigned int CountMinSketch::estimate(const string& key) const
+{
+	if (!bf.isOpen())
+		return 0;
+
+	size_t column[SKETCH_DEPTH];
+	columns(key, column);
+	uint32_t smallest = m_counters[column[0]];
+	for (unsigned int row = 1; row < SKETCH_DEPTH; ++row)
+		if (m_counters[row * m_header.m_width + column[row]] < smallest)
+			smallest = m_counters[row * m_header.m_width + column[row]];
+	return smallest;
+}
+
+unsigned int CountMinSketch::errorBound() const
+{
+	return static_cast<unsigned int>(ceil(exp(1.0) / m_header.m_width * m_header.m_total));
+}
+
+bool CountMinSketch::flush()
+{
+	if (!bf.isOpen())
+		return false;
+	if (!m_dirty)
+		return true;
+
+	// The counters have to be on disk before the header says they are up to date
+	m_dirty = false;
+	m_header.m_clean = 0;
+	return bf.write(m_header, 0)
+		&& bf.write(reinterpret_cast<const char*>(m_counters.data()), m_counters.size() * sizeof(uint32_t), sizeof(m_header))
+		&& bf.sync()
+		&& writeClean(true);
+}
+
+unsigned int CountMinSketch::widthFor(unsigned long long expectedKeys)
+{
+	unsigned int width = SKETCH_MIN_WIDTH;
+	while (width < expectedKeys && width < SKETCH_MAX_WIDTH)
+		width *= 2;
+	return width;
+}
+
+
+/////////////////////////////////
+//	Helper Functions
+/////////////////////////////////
+
+bool CountMinSketch::validWidth(unsigned int width)
+{
+	// The row hashes need a power of two (see columns())
+	return width >= SKETCH_MIN_WIDTH && width <= SKETCH_MAX_WIDTH && (width & (width - 1)) == 0;
+}
+
+bool CountMinSketch::writeClean(bool clean)
+{
+	m_header.m_clean = clean;
+	return bf.write(m_header, 0) && bf.sync();
+}
+
+void CountMinSketch::columns(const string& key, size_t* column) const
+{
+	// Derive one hash per row from two base hashes (h1 + row * h2), where h2 is
+	// a scrambled copy of h1 forced to be odd so the rows never coincide.
+	uint64_t h1 = hash<string>()(key);
+	uint64_t h2 = h1;
+	h2 ^= h2 >> 33;
+	h2 *= 0xc4ceb9fe1a85ec53ULL;
+	h2 ^= h2 >> 33;
+	h2 |= 1;
+	for (unsigned int row = 0; row < SKETCH_DEPTH; ++row)
+		column[row] = static_cast<size_t>((h1 + row * h2) % m_header.m_width);
+}
@@ -0,0 +1,79 @@
+// CountMinSketch keeps an approximate count of how many times each key has been added,
+// in a fixed amount of memory no matter how many different keys there are. IntelWeb uses
+// it to estimate the prevalence of an entity without walking its DiskMultiMap chains.
+//
+// The sketch is a table of SKETCH_DEPTH rows of width counters. Adding a key adds
+// to one counter in every row (each row uses a different hash of the key), and the
+// estimate for a key is the smallest of its counters. Other keys hashing to the same
+// counters can only make an estimate too high, never too low, so:
+//   - estimate(key) >= the real count, always (as long as every add() is matched by the
+//     real change, including negative ones for removals)
+//   - estimate(key) <= the real count + errorBound(), except with probability about
+//     e^-SKETCH_DEPTH, where errorBound() is e / width times the total of all counts
+//
+// So the width has to grow with the number of counts for errorBound() to stay small.
+// widthFor() picks one for an expected number of keys: the next power of two, between
+// SKETCH_MIN_WIDTH and SKETCH_MAX_WIDTH (256 MiB of counters). The width is stored in the
+// file's header.
+//
+// The whole table lives in memory and is written to its file by flush() (and close()).
+// The file says whether it is up to date: the first add() after a flush() marks it dirty
+// (and waits for that to reach the disk) before anything else can change, and flush()
+// marks it clean again once the counters are on disk. openExisting() refuses a dirty file,
+// eg. one left behind by a crash, since its counts may be too low.
+
+#ifndef COUNTMINSKETCH_H_
+#define COUNTMINSKETCH_H_
+
+#include "BinaryFile.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Global Variables
+const unsigned int SKETCH_DEPTH = 4;
+const unsigned int SKETCH_MIN_WIDTH = 1 << 16;
+const unsigned int SKETCH_MAX_WIDTH = 1 << 24;
+const uint32_t SKETCH_VERSION = 2; // version 1 had no clean flag
+
+class CountMinSketch
+{
+public:
+	CountMinSketch();
+	~CountMinSketch();
+	bool createNew(const std::string& filename, unsigned int width = SKETCH_MIN_WIDTH);
+	bool openExisting(const std::string& filename);
+	void close();
+	bool isOpen() const;
+	void add(const std::string& key, int count = 1);
+	unsigned int estimate(const std::string& key) const;
+	unsigned int errorBound() const;
+	bool flush();
+	static unsigned int widthFor(unsigned long long expectedKeys);
+
+private:
+	struct Header
+	{
+		Header(unsigned int width = SKETCH_MIN_WIDTH)
+			: m_depth(SKETCH_DEPTH), m_width(width), m_version(SKETCH_VERSION),
+			m_clean(1), m_total(0) {}
+
+		uint32_t m_depth;
+		uint32_t m_width;
+		uint32_t m_version;
+		uint32_t m_clean; // whether the counters on disk are up to date
+		uint64_t m_total;
+	};
+
+	BinaryFile	bf;
+	Header		m_header;
+	std::vector<uint32_t> m_counters; // row after row
+	bool		m_dirty;
+
+private:
+	void columns(const std::string& key, size_t* column) const;
+	bool writeClean(bool clean);
+	static bool validWidth(unsigned int width);
+};
+
+#endif // COUNTMINSKETCH_H_
@@ -0,0 +1,46 @@
+// The CrawlOptions structure holds the budgets of a bounded crawl: how many hops away from
+// the indicators it may go (maxDepth, where the indicators themselves are 0 hops away), how
+// many bad entities and interactions it may output, and the time by which it must return.
+// Every budget is unlimited unless set. A crawl that runs out of a budget stops early and
+// outputs what it has found so far, and says which budget stopped it with a CrawlStop.
+// The deadline is checked before each entity and every CRAWL_DEADLINE_CHECK_INTERVAL
+// interactions, so an entity with many interactions can't keep the crawl going for long.
+//
+// Which entities and interactions a crawl stopped by maxEntities, maxInteractions or the
+// deadline outputs depends on the order it visits them in. IntelWeb's hash tables and a
+// loaded IntelGraph keep an entity's interactions in different orders, so such partial
+// results can differ between the two (both are still within the budgets). Complete crawls
+// and crawls only limited by maxDepth give the same results either way.
+
+#ifndef CRAWLOPTIONS_H_
+#define CRAWLOPTIONS_H_
+
+#include <chrono>
+#include <climits>
+
+// Global Variables
+const unsigned int CRAWL_DEADLINE_CHECK_INTERVAL = 64; // interactions between clock reads
+
+enum CrawlStop
+{
+	CRAWL_COMPLETE,			// nothing was left to crawl
+	CRAWL_MAX_DEPTH,		// entities more than maxDepth hops away were left out
+	CRAWL_MAX_ENTITIES,
+	CRAWL_MAX_INTERACTIONS,
+	CRAWL_DEADLINE
+};
+
+struct CrawlOptions
+{
+	CrawlOptions()
+		: maxDepth(UINT_MAX), maxEntities(UINT_MAX), maxInteractions(UINT_MAX),
+		deadline(std::chrono::steady_clock::time_point::max())
+	{}
+
+	unsigned int maxDepth;
+	unsigned int maxEntities;
+	unsigned int maxInteractions;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+#endif // CRAWLOPTIONS_H_
@@ -1,10 +1,12 @@
 #include "DiskMultiMap.h"
+#include <cstdio>
 #include <functional>
+#include <map>
 #include <vector>
 using namespace std;
 
 DiskMultiMap::DiskMultiMap()
-	: m_fileOpen(false) {}
+	: m_fileOpen(false), m_failed(false), m_inBatch(false), m_headerDirty(false) {}
 
 DiskMultiMap::~DiskMultiMap()
 {
@@ -15,23 +17,28 @@ bool DiskMultiMap::createNew(const string& filename, unsigned int numBuckets)
 {
 	close();
 
-	// Create empty file
+	// Create empty file, and throw away any journal left behind by an old file of the same name
 	if (!bf.createNew(filename))
 		return false;
+	remove(journalName(filename).c_str());
 
 	// Create necessary header in the file
-	m_header.m_numBuckets = numBuckets;
+	m_header = Header(numBuckets);
+	m_header.m_end = m_header.m_capacity = dataStart();
 	if (!bf.write(m_header, 0))
 		return false;
 
 	// Create "array" of numBuckets buckets, intialized to 0
 	BinaryFile::Offset* array = new BinaryFile::Offset[numBuckets]();
-	if (!bf.write(reinterpret_cast<const char*>(array), sizeof(size_t) * numBuckets, sizeof(m_header)))
-		return false;
+	bool written = bf.write(reinterpret_cast<const char*>(array), sizeof(BinaryFile::Offset) * numBuckets, sizeof(m_header));
 	delete [] array;
+	if (!written)
+		return false;
 	
 	// Update private member variables
+	m_filename = filename;
 	m_fileOpen = true;
+	m_failed = false;
 	return true;
 }
 
@@ -41,86 +48,151 @@ bool DiskMultiMap::openExisting(const string& filename)
 	if (!bf.openExisting(filename))
 		return false;
 
+	// Refuse anything that isn't a table in our format (the magic number and version
+	// are never rewritten, so an interrupted batch can't have touched them)
+	if (!bf.read(m_header, 0) || m_header.m_magic != HEADER_MAGIC || m_header.m_version != HEADER_VERSION)
+	{
+		bf.close();
+		return false;
+	}
+
+	// Finish (or discard) a batch that was interrupted before the last close
+	if (!recoverJournal(filename))
+	{
+		bf.close();
+		return false;
+	}
+
 	// Update private member variables
 	if (!bf.read(m_header, 0))
+	{
+		bf.close();
 		return false;
+	}
+	m_filename = filename;
 	m_fileOpen = true;
+	m_failed = false;
 	return true;
 }
 
 void DiskMultiMap::close()
 {
+	if (m_inBatch)
+		commitBatch();
 	bf.close();
+	m_fileOpen = false;
 }
 
-bool DiskMultiMap::insert(const string& key, const string& value, const string& context)
+bool DiskMultiMap::beginBatch()
 {
-	if (key.size() > CHARLIMIT || value.size() > CHARLIMIT || value.size() > CHARLIMIT
-		|| !m_fileOpen)
+	if (!m_fileOpen || m_failed || m_inBatch)
 		return false;
-	
-	// Find first available space
-	BinaryFile::Offset firstOpen;
-	if (!m_header.m_freespace) // == 0
-		firstOpen = bf.fileLength();
-	else
+	m_inBatch = true;
+	return true;
+}
+
+bool DiskMultiMap::commitBatch()
+{
+	if (!m_inBatch)
+		return false;
+	m_inBatch = false;
+	if (!m_headerDirty && m_dirtyBuckets.empty() && m_dirtyNodes.empty())
+		return true;
+
+	// Gather every dirty item, ordered by where it lives in the file
+	map<BinaryFile::Offset, pair<const char*, size_t> > dirty;
+	if (m_headerDirty)
+		dirty[0] = make_pair(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+	for (map<BinaryFile::Offset, BinaryFile::Offset>::iterator it = m_dirtyBuckets.begin();
+		it != m_dirtyBuckets.end(); ++it)
+		dirty[it->first] = make_pair(reinterpret_cast<const char*>(&it->second), sizeof(it->second));
+	for (map<BinaryFile::Offset, DiskNode>::iterator it = m_dirtyNodes.begin();
+		it != m_dirtyNodes.end(); ++it)
+		dirty[it->first] = make_pair(reinterpret_cast<const char*>(&it->second), sizeof(it->second));
+
+	// 1) Write everything to the journal and wait for it to reach the disk, then
+	// add the commit marker and wait for that too. The records are on disk before
+	// the marker can be, so a journal with a marker is always complete. Until then
+	// the table file itself has not been touched, so a crash just loses the batch.
+	BinaryFile journal;
+	bool committed = journal.createNew(journalName(m_filename));
+	BinaryFile::Offset journalOffset = 0;
+	for (map<BinaryFile::Offset, pair<const char*, size_t> >::iterator it = dirty.begin();
+		it != dirty.end() && committed; ++it)
 	{
-		firstOpen = m_header.m_freespace;
-		// Since we will be overwriting a previously used node,
-		// we need to update the freespace list by pointing its
-		// head at the next node on the freespace list.
-		DiskNode temp;
-		bf.read(temp, m_header.m_freespace); // store 1st free node to temp
-		m_header.m_freespace = temp.next_key; // update new head to next free node
-		bf.write(m_header, 0); // write to file
+		JournalRecord record(it->first, static_cast<uint32_t>(it->second.second));
+		committed = journal.write(record, journalOffset)
+			&& journal.write(it->second.first, it->second.second, journalOffset + sizeof(record));
+		journalOffset += sizeof(record) + it->second.second;
 	}
+	committed = committed && journal.sync()
+		&& journal.write(JournalRecord(JOURNAL_COMMIT, 0), journalOffset)
+		&& journal.sync() && BinaryFile::syncDirectoryOf(journalName(m_filename));
+	journal.close();
 
-	// Write new DiskNode at first available freespace.
-	// Find the bucket offset using the built-in hash function.
-	// 1) If bucket is empty, bucket offset points to new DiskNode, 
-	// and set new next_key and next_equal to 0.
+	// 2) Apply the batch to the table in offset order, then drop the journal.
+	// If we crash in between, openExisting() replays the journal.
+	for (map<BinaryFile::Offset, pair<const char*, size_t> >::iterator it = dirty.begin();
+		it != dirty.end() && committed; ++it)
+		committed = bf.write(it->second.first, it->second.second, it->first);
+	committed = committed && bf.sync();
+	if (committed)
+		remove(journalName(m_filename).c_str());
+	else
+		m_failed = true; // m_header is ahead of the table, and the journal must survive
+
+	m_headerDirty = false;
+	m_dirtyBuckets.clear();
+	m_dirtyNodes.clear();
+	return committed;
+}
+
+bool DiskMultiMap::insert(const string& key, const string& value, const string& context)
+{
+	if (key.size() > CHARLIMIT || value.size() > CHARLIMIT || context.size() > CHARLIMIT
+		|| !m_fileOpen || m_failed)
+		return false;
+
+	// Find the bucket offset using the built-in hash function, then search 
+	// through the nodes until a matching key has been found, or next_key == 0.
 	const char* key_c = key.c_str();
 	const char* value_c = value.c_str();
 	const char* context_c = context.c_str();
 	BinaryFile::Offset bucketOffset = getBucketOffsetFromKey(key);
 	BinaryFile::Offset bucketValue;
-	bf.read(bucketValue, bucketOffset);
-	if (!bucketValue) // empty bucket
+	readBucket(bucketValue, bucketOffset);
+	BinaryFile::Offset curOffset = bucketValue; 
+	DiskNode cur;
+	while (curOffset) // valid node
 	{
-		bf.write(DiskNode(key_c, value_c, context_c), firstOpen);
-		bf.write(firstOpen, bucketOffset);
+		readNode(cur, curOffset);
+		if (strcmp(cur.key, key_c) == 0)
+			break;
+		curOffset = cur.next_key;
+	}
+
+	// Find first available space, as close as possible to the nodes
+	// already holding this key (or at least this bucket).
+	BinaryFile::Offset firstOpen = allocateNode(curOffset ? curOffset : bucketValue);
+	if (!firstOpen)
+		return false;
+
+	// Write new DiskNode at first available freespace.
+	// 1) If a matching key has been found, add new DiskNode,
+	// set next_equal == cur.next_equal, and cur.next_equal = new DiskNode.
+	// 2) If no matching key can be found (or the bucket is empty),
+	// add new DiskNode to the front of the list, assign its next_key
+	// to the node pointed to by bucket, then update bucket to the new node.
+	if (curOffset) // found a matching key!
+	{
+		writeNode(DiskNode(key_c, value_c, context_c, 0, cur.next_equal), firstOpen);
+		cur.next_equal = firstOpen;
+		writeNode(cur, curOffset);
 	}
-	// 2) If bucket is non-empty, search through the nodes until 
-	// a matching key has been found, or next_key == 0. 
-	//		a) If a matching key has been found, add new DiskNode,
-	//		set next_equal == cur.next_equal,
-	//		and cur.next_equal = new DiskNode.
-	//		b) If no matching key can be found, add new DiskNode 
-	//		to the front of the list, assign its next_key to the
-	//		node pointed to by bucket, then update bucket to the
-	//		new node.
 	else
 	{
-		BinaryFile::Offset curOffset = bucketValue; 
-		DiskNode cur;
-		while (curOffset) // valid node
-		{
-			bf.read(cur, curOffset);
-			if (strcmp(cur.key, key_c) == 0)
-				break;
-			curOffset = cur.next_key;
-		}
-		if (curOffset) // found a matching key!
-		{
-			bf.write(DiskNode(key_c, value_c, context_c, 0, cur.next_equal), firstOpen);
-			cur.next_equal = firstOpen;
-			bf.write(cur, curOffset);
-		}
-		else
-		{
-			bf.write(DiskNode(key_c, value_c, context_c, bucketValue), firstOpen);
-			bf.write(firstOpen, bucketOffset);
-		}
+		writeNode(DiskNode(key_c, value_c, context_c, bucketValue), firstOpen);
+		writeBucket(firstOpen, bucketOffset);
 	}
 	return true;
 }
@@ -133,7 +205,7 @@ DiskMultiMap::Iterator DiskMultiMap::search(const string& key)
 	
 	BinaryFile::Offset bucketOffset = getBucketOffsetFromKey(key);
 	BinaryFile::Offset bucketValue;
-	bf.read(bucketValue, bucketOffset);
+	readBucket(bucketValue, bucketOffset);
 	if (bucketValue) // bucket not empty
 	{
 		const char* key_c = key.c_str();
@@ -141,14 +213,14 @@ DiskMultiMap::Iterator DiskMultiMap::search(const string& key)
 		DiskNode cur;
 		while (curOffset) // valid node
 		{
-			bf.read(cur, curOffset);
+			readNode(cur, curOffset);
 			if (strcmp(cur.key, key_c) == 0)
 				break;
 			curOffset = cur.next_key;
 		}
 		if (curOffset) // found a matching key!
 		{
-			DiskMultiMap::Iterator temp(&bf, curOffset);
+			DiskMultiMap::Iterator temp(this, curOffset);
 			return temp;
 		}
 	}
@@ -158,7 +230,7 @@ DiskMultiMap::Iterator DiskMultiMap::search(const string& key)
 int DiskMultiMap::erase(const string& key, const string& value, const string& context)
 {
 	if (key.size() > CHARLIMIT || value.size() > CHARLIMIT || context.size() > CHARLIMIT
-		|| !m_fileOpen)
+		|| !m_fileOpen || m_failed)
 		return 0;
 
 	const char* key_c = key.c_str();
@@ -166,69 +238,73 @@ int DiskMultiMap::erase(const string& key, const string& value, const string& co
 	const char* context_c = context.c_str();
 	BinaryFile::Offset bucketOffset = getBucketOffsetFromKey(key);
 	BinaryFile::Offset bucketValue;
-	bf.read(bucketValue, bucketOffset);
+	readBucket(bucketValue, bucketOffset);
 	if (!bucketValue) // key not found
 		return 0;
 
-	BinaryFile::Offset curOffset = bucketValue, prevOffset = 0;
-	DiskNode cur, prev;
+	BinaryFile::Offset curOffset = bucketValue, keyPrevOffset = 0;
+	DiskNode cur, keyPrev;
 	while (curOffset) // going through the linked list (horizontal)
 	{
-		bf.read(cur, curOffset);
+		readNode(cur, curOffset);
 		if (strcmp(cur.key, key_c) == 0)
 			break;
-		prevOffset = curOffset;
+		keyPrevOffset = curOffset;
 		curOffset = cur.next_key;
-		prev = cur;
+		keyPrev = cur;
 	}
 	if (!curOffset) // key not found
 		return 0;
 
 	// Only the key has been found so far! Now loop through the linked list with matching keys (vertical).
+	// keyPrev is the node before the vertical list on the horizontal list (keyPrevOffset == 0 if
+	// the bucket points straight at it), and prev is the last node we kept on the vertical list
+	// (prevOffset == 0 while every node so far has been erased, ie. cur is the head of the list).
 	int numErased = 0;
+	BinaryFile::Offset prevOffset = 0;
+	DiskNode prev;
 	while (curOffset)
 	{
+		BinaryFile::Offset nextOffset = cur.next_equal;
 		if (strcmp(cur.value, value_c) == 0 && strcmp(cur.context, context_c) == 0) // MATCH FOUND!
 		{
-			DiskNode next;
 			// Update all necessary "pointers"
-			if (bucketValue == curOffset) // 1st node of bucket
+			if (!prevOffset) // cur is the 1st node of its vertical list
 			{
+				// Since only the 1st node of the vertical linked list has a proper next_key pointer,
+				// if we delete the first node, the 2nd node takes over its next_key pointer and its
+				// place on the horizontal list. With no 2nd node, the horizontal list skips cur.
+				BinaryFile::Offset replacement = cur.next_key;
 				if (cur.next_equal)
 				{
-					// Since only the 1st node of the vertical linked list has a proper next_key pointer,
-					// if we delete the first node, we need to update the 2nd node's next_key pointer
-					bf.read(next, cur.next_equal);
+					DiskNode next;
+					readNode(next, cur.next_equal);
 					next.next_key = cur.next_key;
-					bf.write(next, cur.next_equal);
-					bf.write(cur.next_equal, bucketOffset); // update where bucket points to
+					writeNode(next, cur.next_equal);
+					replacement = cur.next_equal;
 				}
-				bf.write(cur.next_key, bucketOffset); // update where bucket points to
-			}
-			else // not the 1st node of bucket
-			{
-				if (prev.next_key == curOffset) // cur is 1st node of a vertical list; prev and cur on SEPARATE vertical lists
+				if (!keyPrevOffset) // 1st node of bucket
+					writeBucket(replacement, bucketOffset); // update where bucket points to
+				else
 				{
-					if (cur.next_equal) // see case when 1st node of bucket above
-					{
-						bf.read(next, cur.next_equal);
-						next.next_key = cur.next_key;
-						bf.write(next, cur.next_equal);
-					}
-					prev.next_key = cur.next_equal ? cur.next_equal : cur.next_key;
+					keyPrev.next_key = replacement;
+					writeNode(keyPrev, keyPrevOffset);
 				}
-				else // cur is NOT 1st node of a vertical list; prev and cur are on SAME vertical list
-					prev.next_equal = cur.next_equal;
-				bf.write(prev, prevOffset);
+			}
+			else // cur is NOT 1st node of a vertical list; prev and cur are on SAME vertical list
+			{
+				prev.next_equal = cur.next_equal;
+				writeNode(prev, prevOffset);
 			}
 
-			// Add deleted node (cur) to our freespace list. cur is now at the 
-			// front of our freespace list, and its next offset (using next_key)
-			// must be the previous front of our freespace list.
-			cur.next_key = m_header.m_freespace;
-			m_header.m_freespace = curOffset;
-			bf.write(cur, curOffset);
-			bf.write(m_header, 0);
+			// Add deleted node (cur) to the freespace list of its region. cur is now
+			// at the front of that list, and its next offset (using next_key)
+			// must be the previous front of the list.
+			unsigned int region = regionOf(curOffset);
+			cur.next_key = m_header.m_freespace[region];
+			m_header.m_freespace[region] = curOffset;
+			writeNode(cur, curOffset);
+			writeHeader();
 
 			numErased++; // update number of erased items
 		}
@@ -237,14 +313,48 @@ int DiskMultiMap::erase(const string& key, const string& value, const string& co
 			prevOffset = curOffset;
 			prev = cur;
 		}
-		curOffset = cur.next_equal; // advance to next_equal
+		curOffset = nextOffset; // advance to next_equal
 		if (curOffset)
-			bf.read(cur, curOffset);
+			readNode(cur, curOffset);
 	}
 	
 	return numErased;
 }
 
+unsigned int DiskMultiMap::numBuckets() const
+{
+	return m_fileOpen ? m_header.m_numBuckets : 0;
+}
+
+bool DiskMultiMap::scanBucket(unsigned int bucket, vector<MultiMapTuple>& tuples)
+{
+	tuples.clear();
+	if (!m_fileOpen || bucket >= m_header.m_numBuckets)
+		return false;
+
+	// Walk every key in the bucket (horizontal) and every node of each key (vertical)
+	BinaryFile::Offset keyOffset;
+	if (!readBucket(keyOffset, sizeof(m_header) + bucket * sizeof(BinaryFile::Offset)))
+		return false;
+	DiskNode cur;
+	for (; keyOffset; keyOffset = cur.next_key)
+	{
+		for (BinaryFile::Offset curOffset = keyOffset; curOffset; curOffset = cur.next_equal)
+		{
+			if (!readNode(cur, curOffset))
+				return false;
+			MultiMapTuple m;
+			m.key = cur.key;
+			m.value = cur.value;
+			m.context = cur.context;
+			tuples.push_back(m);
+		}
+		if (!readNode(cur, keyOffset)) // for its next_key
+			return false;
+	}
+	return true;
+}
+
 
 /////////////////////////////////
 //	Iterator Implementations
@@ -257,7 +367,7 @@ DiskMultiMap::Iterator::Iterator()
 	cache_offset = 0;
 }
 
-DiskMultiMap::Iterator::Iterator(BinaryFile* src, BinaryFile::Offset offset)
+DiskMultiMap::Iterator::Iterator(DiskMultiMap* src, BinaryFile::Offset offset)
 {
 	m_src = src;
 	it_offset = offset;
@@ -275,7 +385,7 @@ DiskMultiMap::Iterator &DiskMultiMap::Iterator::operator++()
 		return *this;
 
 	DiskNode temp;
-	m_src->read(temp, it_offset);
+	m_src->readNode(temp, it_offset);
 	it_offset = temp.next_equal;
 	return *this;
 }
@@ -292,7 +402,7 @@ MultiMapTuple DiskMultiMap::Iterator::operator*()
 	else if (cache_offset != it_offset)
 	{
 		DiskNode temp;
-		m_src->read(temp, it_offset);
+		m_src->readNode(temp, it_offset);
 		m_cache.key = temp.key;
 		m_cache.value = temp.value;
 		m_cache.context = temp.context;
@@ -310,4 +420,156 @@ BinaryFile::Offset DiskMultiMap::getBucketOffsetFromKey(const string& key)
 {
 	hash<string> hashValue;
 	return hashValue(key) % m_header.m_numBuckets * sizeof(int32_t) + sizeof(m_header);
-}
\ No newline at end of file
+}
+
+BinaryFile::Offset DiskMultiMap::dataStart() const
+{
+	return sizeof(m_header) + m_header.m_numBuckets * sizeof(BinaryFile::Offset);
+}
+
+unsigned int DiskMultiMap::regionOf(BinaryFile::Offset offset) const
+{
+	// Region i holds DiskNodes i * NODES_PER_REGION and up, so a node stays in
+	// the same region however big the file grows.
+	if (offset < dataStart())
+		return 0;
+	size_t region = (offset - dataStart()) / sizeof(DiskNode) / NODES_PER_REGION;
+	return region < NUM_FREE_REGIONS ? static_cast<unsigned int>(region) : NUM_FREE_REGIONS - 1;
+}
+
+BinaryFile::Offset DiskMultiMap::allocateNode(BinaryFile::Offset nearOffset)
+{
+	// 1) Reuse a deleted node, trying the region nearOffset is in first and then
+	// the regions around it, closest first.
+	int preferred = nearOffset ? static_cast<int>(regionOf(nearOffset)) : 0;
+	for (int distance = 0; distance < static_cast<int>(NUM_FREE_REGIONS); ++distance)
+	{
+		int candidates[2] = { preferred - distance, preferred + distance };
+		for (int i = 0; i < (distance ? 2 : 1); ++i)
+		{
+			int region = candidates[i];
+			if (region < 0 || region >= static_cast<int>(NUM_FREE_REGIONS) || !m_header.m_freespace[region])
+				continue;
+			// Since we will be overwriting a previously used node,
+			// we need to update the freespace list by pointing its
+			// head at the next node on the freespace list.
+			BinaryFile::Offset offset = m_header.m_freespace[region];
+			DiskNode temp;
+			readNode(temp, offset); // store 1st free node to temp
+			m_header.m_freespace[region] = temp.next_key; // update new head to next free node
+			writeHeader();
+			return offset;
+		}
+	}
+
+	// 2) Otherwise take the next never-used node after the high-water mark,
+	// growing the file by a whole extent when the preallocated space runs out.
+	if (m_header.m_end + static_cast<BinaryFile::Offset>(sizeof(DiskNode)) > m_header.m_capacity)
+	{
+		BinaryFile::Offset capacity = m_header.m_capacity + NODES_PER_EXTENT * sizeof(DiskNode);
+		if (!bf.extend(capacity))
+			return 0;
+		m_header.m_capacity = capacity;
+	}
+	BinaryFile::Offset offset = m_header.m_end;
+	m_header.m_end += sizeof(DiskNode);
+	writeHeader();
+	return offset;
+}
+
+// While a batch is open, reads see the batch's pending writes, and writes only
+// update the in-memory copies until commitBatch().
+
+bool DiskMultiMap::readNode(DiskNode& node, BinaryFile::Offset offset)
+{
+	if (m_inBatch)
+	{
+		map<BinaryFile::Offset, DiskNode>::iterator it = m_dirtyNodes.find(offset);
+		if (it != m_dirtyNodes.end())
+		{
+			node = it->second;
+			return true;
+		}
+	}
+	return bf.read(node, offset);
+}
+
+bool DiskMultiMap::writeNode(const DiskNode& node, BinaryFile::Offset offset)
+{
+	if (!m_inBatch)
+		return bf.write(node, offset);
+	m_dirtyNodes[offset] = node;
+	return true;
+}
+
+bool DiskMultiMap::readBucket(BinaryFile::Offset& value, BinaryFile::Offset bucketOffset)
+{
+	if (m_inBatch)
+	{
+		map<BinaryFile::Offset, BinaryFile::Offset>::iterator it = m_dirtyBuckets.find(bucketOffset);
+		if (it != m_dirtyBuckets.end())
+		{
+			value = it->second;
+			return true;
+		}
+	}
+	return bf.read(value, bucketOffset);
+}
+
+bool DiskMultiMap::writeBucket(BinaryFile::Offset value, BinaryFile::Offset bucketOffset)
+{
+	if (!m_inBatch)
+		return bf.write(value, bucketOffset);
+	m_dirtyBuckets[bucketOffset] = value;
+	return true;
+}
+
+bool DiskMultiMap::writeHeader()
+{
+	if (!m_inBatch)
+		return bf.write(m_header, 0);
+	m_headerDirty = true;
+	return true;
+}
+
+string DiskMultiMap::journalName(const string& filename)
+{
+	return filename + ".journal";
+}
+
+bool DiskMultiMap::recoverJournal(const string& filename)
+{
+	BinaryFile journal;
+	if (!journal.openExisting(journalName(filename)))
+		return true; // no journal, nothing to recover
+
+	// Walk the records up to the commit marker. A journal without one was cut
+	// short before anything touched the table, so it is simply thrown away.
+	vector<pair<JournalRecord, BinaryFile::Offset> > records;
+	BinaryFile::Offset journalOffset = 0;
+	JournalRecord record;
+	bool complete = false;
+	while (journal.read(record, journalOffset))
+	{
+		if (record.m_offset == JOURNAL_COMMIT)
+		{
+			complete = true;
+			break;
+		}
+		records.push_back(make_pair(record, journalOffset + static_cast<BinaryFile::Offset>(sizeof(record))));
+		journalOffset += sizeof(record) + record.m_length;
+	}
+
+	bool recovered = true;
+	for (size_t i = 0; i < records.size() && complete && recovered; ++i)
+	{
+		vector<char> data(records[i].first.m_length);
+		recovered = journal.read(data.data(), data.size(), records[i].second)
+			&& bf.write(data.data(), data.size(), records[i].first.m_offset);
+	}
+	recovered = recovered && bf.sync();
+	journal.close();
+	if (recovered)
+		remove(journalName(filename).c_str());
+	return recovered;
+}
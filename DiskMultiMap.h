@@ -9,12 +9,38 @@
 //
 // Each DiskMultiMap disk file contains the following information:
 //   - A Header struct that includes:
+//       - A magic number and a format version, checked by openExisting() so that it
+//         refuses files in any other layout (such as tables written before the version
+//         was added, which have to be re-ingested)
 //       - Number of buckets (unsigned int)
-//       - Offset of the next freespace DiskNode
-//           - (For this I used a separate linked list. Each time a DiskNode was 
-//             "deleted", it was added to the freespace linked list)
+//       - The high-water mark (end of the last DiskNode ever written) and the
+//         number of bytes preallocated for the file
+//       - Offsets of the next freespace DiskNode in each of NUM_FREE_REGIONS regions
+//           - (For this I used separate linked lists. Each time a DiskNode was 
+//             "deleted", it was added to the freespace linked list of the region,
+//             ie. the slice of NODES_PER_REGION DiskNodes of the file, it lives in)
 //   - "Array" of buckets, each containing the Offset of a DiskNode's location
 //   - All data that follows are the actual DiskNodes
+//
+// The file grows NODES_PER_EXTENT DiskNodes at a time (reserving the disk space with
+// posix_fallocate()), so most inserts just bump the high-water mark without touching the
+// file length. A new node reuses a deleted one first, taken from the region holding the
+// key's existing nodes (or the closest region that has any), which keeps each key's
+// chain close together on disk.
+//
+// Writes can be grouped with beginBatch()/commitBatch(). Inside a batch the dirty
+// header, buckets and DiskNodes are only kept in memory (searches and iterators see
+// them). commitBatch() first writes them all to a journal file next to the table
+// (filename.journal) and fsyncs it, then appends a commit marker and fsyncs again, then
+// writes them to the table in offset order, fsyncs the table and deletes the journal.
+// If the program or the machine dies before the table has been fully updated,
+// openExisting() replays a complete journal or discards an incomplete one, so the table
+// always holds either all of a batch or none of it. If commitBatch() fails, the map
+// refuses insert(), erase() and beginBatch() until it is opened again, which finishes
+// or discards the failed batch from its journal.
+//
+// scanBucket() reads every tuple stored in one bucket, so the whole table can be read
+// (eg. to load it into memory) one bucket at a time, in any order.
 
 #ifndef DISKMULTIMAP_H_
 #define DISKMULTIMAP_H_
@@ -27,11 +53,16 @@
 
 #include <cstring>
 #include <string>
+#include <map>
+#include <vector>
 #include "MultiMapTuple.h"
 #include "BinaryFile.h"
 
 // Global Variables
 const BinaryFile::Offset CHARLIMIT = 120;
+const unsigned int NUM_FREE_REGIONS = 256;
+const unsigned int NODES_PER_REGION = 32768; // NUM_FREE_REGIONS of these cover a 2GB file
+const unsigned int NODES_PER_EXTENT = 1024;
 
 class DiskMultiMap
 {
@@ -40,13 +71,13 @@ public:
 	{
 	public:
 		Iterator();
-		Iterator(BinaryFile* src, BinaryFile::Offset offset = 0);
+		Iterator(DiskMultiMap* src, BinaryFile::Offset offset = 0);
 		bool isValid() const;
 		Iterator &operator++();
 		MultiMapTuple operator*();
 
 	private:
-		BinaryFile* m_src;
+		DiskMultiMap* m_src;
 		MultiMapTuple m_cache;
 		BinaryFile::Offset it_offset;
 		BinaryFile::Offset cache_offset;
@@ -60,6 +91,10 @@ public:
 	bool insert(const std::string& key, const std::string& value, const std::string& context);
 	Iterator search(const std::string& key);
 	int erase(const std::string& key, const std::string& value, const std::string& context);
+	unsigned int numBuckets() const;
+	bool scanBucket(unsigned int bucket, std::vector<MultiMapTuple>& tuples);
+	bool beginBatch();
+	bool commitBatch();
 
 private:
 	struct DiskNode
@@ -79,21 +114,63 @@ private:
 		BinaryFile::Offset next_equal;
 	};
 
+	static const uint32_t HEADER_MAGIC = 0x50414d44; // "DMAP"
+	static const uint32_t HEADER_VERSION = 2;
+
 	struct Header
 	{
 		Header(unsigned int numBuckets = 0)
-			: m_numBuckets(numBuckets), m_freespace(0) {}
+			: m_magic(HEADER_MAGIC), m_version(HEADER_VERSION), m_numBuckets(numBuckets),
+			m_end(0), m_capacity(0)
+		{
+			for (unsigned int i = 0; i < NUM_FREE_REGIONS; ++i)
+				m_freespace[i] = 0;
+		}
 
+		uint32_t m_magic;
+		uint32_t m_version;
 		unsigned int m_numBuckets;
-		BinaryFile::Offset m_freespace;
+		BinaryFile::Offset m_end;
+		BinaryFile::Offset m_capacity;
+		BinaryFile::Offset m_freespace[NUM_FREE_REGIONS];
 	};
 
+	// Each journal entry is a JournalRecord followed by m_length bytes to be written
+	// at m_offset in the table. A record with m_offset == JOURNAL_COMMIT ends the journal.
+	struct JournalRecord
+	{
+		JournalRecord(BinaryFile::Offset offset = 0, uint32_t length = 0)
+			: m_offset(offset), m_length(length) {}
+
+		BinaryFile::Offset m_offset;
+		uint32_t m_length;
+	};
+	static const BinaryFile::Offset JOURNAL_COMMIT = -1;
+
 	BinaryFile	bf;
 	bool		m_fileOpen;
+	bool		m_failed; // a batch failed to commit, nothing more can be written
 	Header		m_header;
+	std::string	m_filename;
+
+	// Pending batch
+	bool		m_inBatch;
+	bool		m_headerDirty;
+	std::map<BinaryFile::Offset, BinaryFile::Offset> m_dirtyBuckets;
+	std::map<BinaryFile::Offset, DiskNode> m_dirtyNodes;
 
 private:
 	BinaryFile::Offset getBucketOffsetFromKey(const std::string& key);
+	BinaryFile::Offset dataStart() const;
+	unsigned int regionOf(BinaryFile::Offset offset) const;
+	BinaryFile::Offset allocateNode(BinaryFile::Offset nearOffset);
+	bool readNode(DiskNode& node, BinaryFile::Offset offset);
+	bool writeNode(const DiskNode& node, BinaryFile::Offset offset);
+	bool readBucket(BinaryFile::Offset& value, BinaryFile::Offset bucketOffset);
+	bool writeBucket(BinaryFile::Offset value, BinaryFile::Offset bucketOffset);
+	bool writeHeader();
+	static std::string journalName(const std::string& filename);
+	bool recoverJournal(const std::string& filename);
 };
 
 #endif // DISKMULTIMAP_H_
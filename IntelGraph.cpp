@@ -0,0 +1,192 @@
+#include "IntelGraph.h"
+#include "IntelWeb.h" // operator< for InteractionTuple
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <set>
+using namespace std;
+
+IntelGraph::IntelGraph()
+	: m_built(false) {}
+
+void IntelGraph::clear()
+{
+	m_built = false;
+	unordered_map<string, uint32_t>().swap(m_entityIds); // release the memory
+	vector<string>().swap(m_entities);
+	unordered_map<string, uint32_t>().swap(m_contextIds);
+	vector<string>().swap(m_contexts);
+	vector<Interaction>().swap(m_pending);
+	vector<uint32_t>().swap(m_firstEdge);
+	vector<Edge>().swap(m_edges);
+}
+
+void IntelGraph::addInteraction(const string& from, const string& to, const string& context)
+{
+	Interaction i;
+	i.m_from = intern(from, m_entityIds, m_entities);
+	i.m_to = intern(to, m_entityIds, m_entities);
+	i.m_context = intern(context, m_contextIds, m_contexts);
+	m_pending.push_back(i);
+}
+
+void IntelGraph::build()
+{
+	// Interactions from an earlier build() are still there as the edges that their
+	// initiators own, one each.
+	if (m_built)
+		for (uint32_t entity = 0; entity + 1 < m_firstEdge.size(); ++entity)
+			for (uint32_t e = m_firstEdge[entity]; e < m_firstEdge[entity + 1]; ++e)
+				if (m_edges[e].m_initiator)
+				{
+					Interaction i;
+					i.m_from = entity;
+					i.m_to = m_edges[e].m_other;
+					i.m_context = m_edges[e].m_context;
+					m_pending.push_back(i);
+				}
+
+	// Count each entity's edges, turn the counts into slice boundaries, then
+	// fill each slice from its back end.
+	m_firstEdge.assign(m_entities.size() + 1, 0);
+	for (size_t i = 0; i < m_pending.size(); ++i)
+	{
+		m_firstEdge[m_pending[i].m_from + 1]++;
+		m_firstEdge[m_pending[i].m_to + 1]++;
+	}
+	for (size_t entity = 1; entity < m_firstEdge.size(); ++entity)
+		m_firstEdge[entity] += m_firstEdge[entity - 1];
+
+	m_edges.resize(m_pending.size() * 2);
+	vector<uint32_t> fill(m_firstEdge.begin() + 1, m_firstEdge.end());
+	for (size_t i = 0; i < m_pending.size(); ++i)
+	{
+		const Interaction& cur = m_pending[i];
+		Edge& out = m_edges[--fill[cur.m_from]];
+		out.m_other = cur.m_to;
+		out.m_context = cur.m_context;
+		out.m_initiator = true;
+		Edge& in = m_edges[--fill[cur.m_to]];
+		in.m_other = cur.m_from;
+		in.m_context = cur.m_context;
+		in.m_initiator = false;
+	}
+	vector<Interaction>().swap(m_pending);
+	m_built = true;
+}
+
+bool IntelGraph::isBuilt() const
+{
+	return m_built;
+}
+
+unsigned int IntelGraph::crawl(const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	const CrawlOptions& options,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions,
+	CrawlStop& stoppedBy) const
+{
+	badEntitiesFound.clear();
+	badInteractions.clear();
+	stoppedBy = CRAWL_COMPLETE;
+	if (!m_built)
+		return 0;
+
+	// Same crawl as IntelWeb::crawl(). Every entity in the graph takes part in some
+	// interaction, so every queued entity is found.
+	vector<bool> queued(m_entities.size(), false);
+	queue<pair<uint32_t, unsigned int> > q; // entity, hops from the nearest indicator
+	for (size_t i = 0; i < indicators.size(); ++i)
+	{
+		unordered_map<string, uint32_t>::const_iterator it = m_entityIds.find(indicators[i]);
+		if (it != m_entityIds.end() && !queued[it->second])
+		{
+			queued[it->second] = true;
+			q.push(make_pair(it->second, 0));
+		}
+	}
+
+	vector<uint32_t> badEntities;
+	set<Interaction> interactions;
+	bool depthLimited = false;
+	unsigned int interactionsSinceCheck = 0;
+	while (!q.empty() && stoppedBy == CRAWL_COMPLETE)
+	{
+		if (chrono::steady_clock::now() >= options.deadline)
+			stoppedBy = CRAWL_DEADLINE;
+		else if (badEntities.size() == options.maxEntities)
+			stoppedBy = CRAWL_MAX_ENTITIES;
+		if (stoppedBy != CRAWL_COMPLETE)
+			break;
+		uint32_t cur = q.front().first;
+		unsigned int depth = q.front().second;
+		q.pop();
+		badEntities.push_back(cur);
+
+		for (uint32_t e = m_firstEdge[cur]; e < m_firstEdge[cur + 1]; ++e)
+		{
+			if (++interactionsSinceCheck == CRAWL_DEADLINE_CHECK_INTERVAL)
+			{
+				interactionsSinceCheck = 0;
+				if (chrono::steady_clock::now() >= options.deadline)
+				{
+					stoppedBy = CRAWL_DEADLINE;
+					break;
+				}
+			}
+			const Edge& edge = m_edges[e];
+			Interaction i;
+			i.m_from = edge.m_initiator ? cur : edge.m_other;
+			i.m_to = edge.m_initiator ? edge.m_other : cur;
+			i.m_context = edge.m_context;
+			if (interactions.size() >= options.maxInteractions && !interactions.count(i))
+			{
+				stoppedBy = CRAWL_MAX_INTERACTIONS;
+				break;
+			}
+			interactions.insert(i); // picked up from both ends if both are bad
+			if (queued[edge.m_other] || degree(edge.m_other) >= minPrevalenceToBeGood)
+				continue;
+			if (depth < options.maxDepth)
+			{
+				queued[edge.m_other] = true;
+				q.push(make_pair(edge.m_other, depth + 1));
+			}
+			else
+				depthLimited = true;
+		}
+	}
+	if (stoppedBy == CRAWL_COMPLETE && depthLimited)
+		stoppedBy = CRAWL_MAX_DEPTH;
+
+	// Copy over the ordered entities/interactions into the vectors
+	for (size_t i = 0; i < badEntities.size(); ++i)
+		badEntitiesFound.push_back(m_entities[badEntities[i]]);
+	sort(badEntitiesFound.begin(), badEntitiesFound.end());
+	for (set<Interaction>::iterator it = interactions.begin(); it != interactions.end(); ++it)
+		badInteractions.push_back(InteractionTuple(m_entities[it->m_from], m_entities[it->m_to],
+			m_contexts[it->m_context]));
+	sort(badInteractions.begin(), badInteractions.end());
+
+	return badEntities.size();
+}
+
+
+/////////////////////////////////
+//	Helper Functions
+/////////////////////////////////
+
+uint32_t IntelGraph::intern(const string& name, unordered_map<string, uint32_t>& ids, vector<string>& names)
+{
+	pair<unordered_map<string, uint32_t>::iterator, bool> ret;
+	ret = ids.insert(make_pair(name, static_cast<uint32_t>(names.size())));
+	if (ret.second) // first time we've seen it
+		names.push_back(name);
+	return ret.first->second;
+}
+
+uint32_t IntelGraph::degree(uint32_t entity) const
+{
+	return m_firstEdge[entity + 1] - m_firstEdge[entity];
+}
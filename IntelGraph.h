@@ -0,0 +1,83 @@
+// IntelGraph is an in-memory copy of an IntelWeb store, for running many crawls against
+// the same ingested telemetry without going back to disk. IntelWeb::loadGraph() reads
+// every interaction out of the forward hash tables once and builds one of these.
+//
+// Every entity and every context is interned, ie. replaced by a small integer ID, and
+// the interactions are kept in compressed sparse row form: the edges of entity i (one
+// per interaction it takes part in, as the initiator or the target) are the contiguous
+// slice m_edges[m_firstEdge[i], m_firstEdge[i + 1]). So an entity's prevalence is just
+// the length of its slice, and expanding an entity during a crawl is a linear scan of
+// one array.
+//
+// crawl() gives exactly the same results as IntelWeb::crawl() on the store the graph
+// was loaded from (as long as the store hasn't changed since).
+
+#ifndef INTELGRAPH_H_
+#define INTELGRAPH_H_
+
+#include "InteractionTuple.h"
+#include "CrawlOptions.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class IntelGraph
+{
+public:
+	IntelGraph();
+	void clear();
+	void addInteraction(const std::string& from, const std::string& to, const std::string& context);
+	void build();
+	bool isBuilt() const;
+	unsigned int crawl(const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		const CrawlOptions& options,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions,
+		CrawlStop& stoppedBy) const;
+
+private:
+	struct Edge
+	{
+		uint32_t m_other; // the entity at the other end
+		uint32_t m_context;
+		bool m_initiator; // whether the entity owning the edge is the interaction's from
+	};
+
+	struct Interaction
+	{
+		uint32_t m_from;
+		uint32_t m_to;
+		uint32_t m_context;
+
+		bool operator<(const Interaction& other) const
+		{
+			if (m_from != other.m_from)
+				return m_from < other.m_from;
+			if (m_to != other.m_to)
+				return m_to < other.m_to;
+			return m_context < other.m_context;
+		}
+		bool operator==(const Interaction& other) const
+		{
+			return m_from == other.m_from && m_to == other.m_to && m_context == other.m_context;
+		}
+	};
+
+	bool m_built;
+	std::unordered_map<std::string, uint32_t> m_entityIds;
+	std::vector<std::string> m_entities;
+	std::unordered_map<std::string, uint32_t> m_contextIds;
+	std::vector<std::string> m_contexts;
+	std::vector<Interaction> m_pending; // added since the last build()
+	std::vector<uint32_t> m_firstEdge; // one per entity, plus one past the end
+	std::vector<Edge> m_edges;
+
+private:
+	static uint32_t intern(const std::string& name, std::unordered_map<std::string, uint32_t>& ids,
+		std::vector<std::string>& names);
+	uint32_t degree(uint32_t entity) const;
+};
+
+#endif // INTELGRAPH_H_
@@ -3,11 +3,27 @@
 #include <fstream>  // needed in addition to <iostream> for file I/O
 #include <sstream>  // needed in addition to <iostream> for string stream I/O
 #include <queue>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <thread>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
 using namespace std;
 
+// Number of interactions inserted into a shard before its batch of writes is committed
+// (also the size of the chunks the ingest workers hand over)
+const unsigned int INGEST_BATCH_SIZE = 4096;
+// Most parsed chunks that may wait to be inserted during a multi-stream ingest
+const unsigned int INGEST_QUEUE_CHUNKS = 16;
+
 IntelWeb::IntelWeb()
 {
 	m_fileOpen = false;
+	m_approximatePrevalence = false;
+	m_sharingLookups = false;
 }
 
 IntelWeb::~IntelWeb()
@@ -15,15 +31,38 @@ IntelWeb::~IntelWeb()
 	close();
 }
 
-bool IntelWeb::createNew(const string& filePrefix, unsigned int maxDataItems)
+bool IntelWeb::createNew(const string& filePrefix, unsigned int maxDataItems, unsigned int numShards,
+	bool orderedIndex)
 {
 	close();
+	if (numShards == 0)
+		return false;
+	removeStore(filePrefix); // so no file of an old store can be mistaken for ours
 
 	float L = 0.75;	// update to change load factor
-	int numBuckets = maxDataItems * (1 / L);
+	int numBuckets = maxDataItems * (1 / L) / numShards;
+	if (numBuckets < 1)
+		numBuckets = 1;
 
-	if (forward.createNew(filePrefix + "_forward_hash_table.dat", numBuckets)
-		&& reverse.createNew(filePrefix + "_reverse_hash_table.dat", numBuckets))
+	bool created = true;
+	for (unsigned int i = 0; i < numShards && created; ++i)
+	{
+		forward.push_back(unique_ptr<DiskMultiMap>(new DiskMultiMap));
+		reverse.push_back(unique_ptr<DiskMultiMap>(new DiskMultiMap));
+		created = forward[i]->createNew(shardFileName(filePrefix, "forward", i, numShards), numBuckets)
+			&& reverse[i]->createNew(shardFileName(filePrefix, "reverse", i, numShards), numBuckets);
+	}
+	if (created)
+		created = m_sketch.createNew(filePrefix + "_prevalence_sketch.dat",
+			CountMinSketch::widthFor(static_cast<unsigned long long>(numBuckets) * numShards));
+	if (created && orderedIndex)
+		created = m_index.createNew(filePrefix + "_ordered_index.dat");
+	if (created)
+	{
+		ofstream shards(filePrefix + "_shards.txt");
+		created = static_cast<bool>(shards << numShards << '\n');
+	}
+	if (created)
 	{
 		m_fileOpen = true;
 		return true;
@@ -37,8 +76,25 @@ bool IntelWeb::openExisting(const string& filePrefix)
 {
 	close();
 
-	if (forward.openExisting(filePrefix + "_forward_hash_table.dat")
-		&& reverse.openExisting(filePrefix + "_reverse_hash_table.dat"))
+	unsigned int numShards = storedShardCount(filePrefix);
+	bool opened = numShards > 0;
+	for (unsigned int i = 0; i < numShards && opened; ++i)
+	{
+		forward.push_back(unique_ptr<DiskMultiMap>(new DiskMultiMap));
+		reverse.push_back(unique_ptr<DiskMultiMap>(new DiskMultiMap));
+		opened = forward[i]->openExisting(shardFileName(filePrefix, "forward", i, numShards))
+			&& reverse[i]->openExisting(shardFileName(filePrefix, "reverse", i, numShards));
+	}
+	// The prevalence sketch and ordered index are optional
+	// A sketch or index that wasn't flushed after its last change (eg. because of a
+	// crash) may be missing entities, so it is built again from the hash tables.
+	string sketchName = filePrefix + "_prevalence_sketch.dat";
+	string indexName = filePrefix + "_ordered_index.dat";
+	bool rebuildSketch = opened && ifstream(sketchName) && !m_sketch.openExisting(sketchName);
+	bool rebuildIndex = opened && ifstream(indexName) && !m_index.openExisting(indexName);
+	if (rebuildSketch || rebuildIndex)
+		opened = rebuildTracking(rebuildSketch ? sketchName : "", rebuildIndex ? indexName : "");
+	if (opened)
 	{
 		m_fileOpen = true;
 		return true;
@@ -48,10 +104,32 @@ bool IntelWeb::openExisting(const string& filePrefix)
 	return false;
 }
 
+bool IntelWeb::removeStore(const string& filePrefix)
+{
+	unsigned int numShards = storedShardCount(filePrefix);
+	bool removed = numShards > 0;
+	for (unsigned int i = 0; i < numShards; ++i)
+		removed = removeShard(filePrefix, i, numShards) && removed;
+
+	// Also take out any shard files left behind by an older store of the same name
+	removeShard(filePrefix, 0, 1);
+	for (unsigned int i = numShards > 1 ? numShards : 0; removeShard(filePrefix, i, 2); ++i)
+		;
+	remove((filePrefix + "_shards.txt").c_str());
+	remove((filePrefix + "_prevalence_sketch.dat").c_str()); // optional files
+	OrderedIndex::removeFiles(filePrefix + "_ordered_index.dat");
+	return removed;
+}
+
 void IntelWeb::close()
 {
-	forward.close();
-	reverse.close();
+	forward.clear(); // DiskMultiMap destructors close the files
+	reverse.clear();
+	m_sketch.close();
+	m_index.close();
+	m_graph.clear();
+	forgetSharedLookups();
+	m_fileOpen = false;
 }
 
 bool IntelWeb::ingest(const string& telemetryFile)
@@ -63,160 +141,695 @@ bool IntelWeb::ingest(const string& telemetryFile)
 	ifstream inf(telemetryFile);
 	if (!inf)
 		return false;
+	return ingest(inf);
+}
+
+bool IntelWeb::ingest(istream& telemetry)
+{
+	if (!m_fileOpen)
+		return false;
 
 	string line;
-	while (getline(inf, line))
+	InteractionTuple t;
+	unsigned int batched = 0;
+	beginBatch();
+	while (getline(telemetry, line))
 	{
-		istringstream iss(line);
-		string context, from, to;
-		if (!(iss >> context >> from >> to))
+		if (!parseLine(line, t))
 			continue; // line has bad formatting, skip
 
 		// Insert into respective diskmultimaps
-		if (!forward.insert(from, to, context)
-			|| !reverse.insert(to, from, context))
+		if (!forwardShard(t.from).insert(t.from, t.to, t.context)
+			|| !reverseShard(t.to).insert(t.to, t.from, t.context))
+		{
+			commitBatch();
 			return false;
+		}
+		trackInteraction(t);
+		if (++batched == INGEST_BATCH_SIZE)
+		{
+			if (!commitBatch())
+				return false;
+			beginBatch();
+			batched = 0;
+		}
 	}
-	return true;
+	// getline() also stops when the stream fails partway (eg. a decompressing stream
+	// hitting a corrupt block). What was read before that is kept, but it's a failure.
+	bool readAll = telemetry.eof() && !telemetry.bad();
+	bool committed = commitBatch();
+	return flushTracking() && committed && readAll;
+}
+
+bool IntelWeb::ingest(const vector<string>& telemetryFiles)
+{
+	vector<StreamFactory> telemetryStreams;
+	for (size_t i = 0; i < telemetryFiles.size(); ++i)
+		telemetryStreams.push_back(bind(&IntelWeb::openTelemetryFile, telemetryFiles[i]));
+	return ingest(telemetryStreams);
+}
+
+bool IntelWeb::ingest(const vector<StreamFactory>& telemetryStreams)
+{
+	if (!m_fileOpen)
+		return false;
+
+	// Streams are opened and parsed on up to numWorkers worker threads, which hand
+	// the parsed interactions over in chunks of INGEST_BATCH_SIZE. The calling thread
+	// inserts the chunks as they come in. At most INGEST_QUEUE_CHUNKS chunks wait in
+	// the queue (workers block until there is room), so memory use doesn't depend
+	// on how big the streams are.
+	unsigned int numWorkers = thread::hardware_concurrency();
+	if (numWorkers == 0)
+		numWorkers = 1;
+	if (numWorkers > telemetryStreams.size())
+		numWorkers = static_cast<unsigned int>(telemetryStreams.size());
+
+	IngestQueue queue;
+	queue.m_nextStream = 0;
+	queue.m_workersLeft = numWorkers;
+	queue.m_allOpened = true;
+	queue.m_allRead = true;
+	queue.m_cancelled = false;
+	vector<thread> workers;
+	for (unsigned int i = 0; i < numWorkers; ++i)
+		workers.push_back(thread(&IntelWeb::parseStreams, cref(telemetryStreams), ref(queue)));
+
+	bool inserted = true;
+	while (true)
+	{
+		vector<InteractionTuple> chunk;
+		{
+			unique_lock<mutex> lock(queue.m_mutex);
+			while (queue.m_chunks.empty() && queue.m_workersLeft > 0)
+				queue.m_changed.wait(lock);
+			if (queue.m_chunks.empty())
+				break; // every worker is done
+			chunk.swap(queue.m_chunks.front());
+			queue.m_chunks.pop_front();
+			queue.m_changed.notify_all();
+		}
+		if (!insertInteractions(chunk))
+		{
+			inserted = false;
+			lock_guard<mutex> lock(queue.m_mutex);
+			queue.m_cancelled = true; // tell the workers to stop
+			queue.m_changed.notify_all();
+			break;
+		}
+	}
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	bool flushed = flushTracking();
+	// Unreadable streams are skipped, streams failing partway are kept up to the failure
+	return inserted && flushed && queue.m_allOpened && queue.m_allRead;
 }
 
 unsigned int IntelWeb::crawl(const vector<string>& indicators,
 	unsigned int minPrevalenceToBeGood,
 	vector<string>& badEntitiesFound,
-	vector<InteractionTuple>& badInteractions) // !!! queue version
+	vector<InteractionTuple>& badInteractions)
 {
-	if (!m_fileOpen)
-		return 0;
+	CrawlStop stoppedBy;
+	return crawl(indicators, minPrevalenceToBeGood, CrawlOptions(), badEntitiesFound, badInteractions, stoppedBy);
+}
+
+unsigned int IntelWeb::crawl(const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	const CrawlOptions& options,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions,
+	CrawlStop& stoppedBy) // !!! queue version
+{
+	stoppedBy = CRAWL_COMPLETE;
+	if (m_fileOpen && m_graph.isBuilt())
+		return m_graph.crawl(indicators, minPrevalenceToBeGood, options, badEntitiesFound, badInteractions, stoppedBy);
 
 	badEntitiesFound.clear();
 	badInteractions.clear();
-	set<string> badEntitiesSet;
+	if (!m_fileOpen)
+		return 0;
 	set<InteractionTuple> badInteractionsSet;
 
-	// Add all indicators into a queue.
-	queue<string> q;
-	for (int i = 0; i < indicators.size(); ++i)
-		q.push(indicators[i]);
+	// Every entity goes into seen the first time we come across it, and into the queue
+	// (so at most once) if it is an indicator or has a prevalence under our threshold.
+	// Its prevalence can't change during the crawl, so we never need to check it again.
+	set<string> seen;
+	queue<pair<string, unsigned int> > q; // entity, hops from the nearest indicator
+	for (size_t i = 0; i < indicators.size(); ++i)
+		if (seen.insert(indicators[i]).second)
+			q.push(make_pair(indicators[i], 0));
 
 	// Do a search through the queue of indicators
-	unsigned int count = 0;
-	while (!q.empty())
+	bool depthLimited = false;
+	unsigned int interactionsSinceCheck = 0;
+	vector<InteractionTuple> interactions;
+	while (!q.empty() && stoppedBy == CRAWL_COMPLETE)
 	{
-		string cur = q.front();
+		if (chrono::steady_clock::now() >= options.deadline)
+		{
+			stoppedBy = CRAWL_DEADLINE;
+			break;
+		}
+		string cur = q.front().first;
+		unsigned int depth = q.front().second;
 		q.pop();
-		DiskMultiMap::Iterator it = forward.search(cur); // 1st, search our forward hash table
-		if (it.isValid())
+
+		// If we found the indicator in either of our hash tables, it's bad. (If the
+		// deadline passed while reading them, we still take what we got.)
+		if (!lookupInteractions(cur, options.deadline, interactions))
+			stoppedBy = CRAWL_DEADLINE;
+		if (interactions.empty())
+			continue;
+		if (badEntitiesFound.size() == options.maxEntities)
 		{
-			// If we found the indicator in our data, insert the indicator into our set
-			// of badEntitiesFound. If it was already in our set, do nothing.
-			pair<set<string>::iterator, bool> ret;
-			ret = badEntitiesSet.insert(cur);
-			if (ret.second) // insert succeeded, item is unique
-			{
-				count++;
-				// Now we do a check for any newly associated entities. Because our indicator
-				// is always in the first slot, "key", and our third slot is always "context",
-				// a newly associated entity must be in the second slot, "value".
-				for (; it.isValid(); ++it)
-				{
-					MultiMapTuple m = *it;
-					// Add each interaction to our badInteractions set if unique.
-					badInteractionsSet.insert(toInteractionTuple(m, true));
-					if (prevalenceUnderThreshold(m.value, minPrevalenceToBeGood))
-						// New associated entity has a P-value below our threshold, and it
-						// was successfully inserted to our set (which means it's unique).
-						// New entity is now an indicator! Add to queue.
-						q.push(m.value);
-				}
-				it = reverse.search(cur); // now loop through the reverse hash
-				for (; it.isValid(); ++it)
-				{
-					MultiMapTuple m = *it;
-					badInteractionsSet.insert(toInteractionTuple(m, false));
-					if (prevalenceUnderThreshold(m.value, minPrevalenceToBeGood))
-						q.push(m.value);
-				}
-			}
+			stoppedBy = CRAWL_MAX_ENTITIES;
+			break;
 		}
-		it = reverse.search(cur); // 2nd, search our reverse hash table
-		if (it.isValid())
+		badEntitiesFound.push_back(cur);
+
+		// Now we do a check for any newly associated entities: the other end of
+		// each of the indicator's interactions.
+		for (size_t i = 0; i < interactions.size(); ++i)
 		{
-			pair<set<string>::iterator, bool> ret;
-			ret = badEntitiesSet.insert(cur);
-			if (ret.second) // insert succeeded, item is unique
+			if (++interactionsSinceCheck == CRAWL_DEADLINE_CHECK_INTERVAL)
 			{
-				count++;
-				for (; it.isValid(); ++it)
-				{
-					MultiMapTuple m = *it;
-					badInteractionsSet.insert(toInteractionTuple(m, false));
-					if (prevalenceUnderThreshold(m.value, minPrevalenceToBeGood))
-						q.push(m.value);
-				}
-				it = forward.search(cur); // now loop through the forward hash
-				for (; it.isValid(); ++it)
+				interactionsSinceCheck = 0;
+				if (chrono::steady_clock::now() >= options.deadline)
 				{
-					MultiMapTuple m = *it;
-					badInteractionsSet.insert(toInteractionTuple(m, true));
-					if (prevalenceUnderThreshold(m.value, minPrevalenceToBeGood))
-						q.push(m.value);
+					stoppedBy = CRAWL_DEADLINE;
+					break;
 				}
 			}
+			// Add each interaction to our badInteractions set if unique.
+			const InteractionTuple& t = interactions[i];
+			if (badInteractionsSet.size() >= options.maxInteractions && !badInteractionsSet.count(t))
+			{
+				stoppedBy = CRAWL_MAX_INTERACTIONS;
+				break;
+			}
+			badInteractionsSet.insert(t);
+			const string& other = t.from == cur ? t.to : t.from;
+			if (!seen.insert(other).second || !prevalenceUnderThreshold(other, minPrevalenceToBeGood))
+				continue;
+			// New associated entity has a P-value below our threshold, and we haven't
+			// seen it before. New entity is now an indicator! Add to queue (unless
+			// it is too far away).
+			if (depth < options.maxDepth)
+				q.push(make_pair(other, depth + 1));
+			else
+				depthLimited = true;
 		}
 	}
+	if (stoppedBy == CRAWL_COMPLETE && depthLimited)
+		stoppedBy = CRAWL_MAX_DEPTH;
 
 	// Copy over the ordered entities/interactions into the vectors
-	for (set<string>::iterator it = badEntitiesSet.begin();	it != badEntitiesSet.end(); ++it)
-		badEntitiesFound.push_back(*it);
+	sort(badEntitiesFound.begin(), badEntitiesFound.end());
 	for (set<InteractionTuple>::iterator it = badInteractionsSet.begin(); it != badInteractionsSet.end(); ++it)
 		badInteractions.push_back(*it);
 
-	return count;
+	return badEntitiesFound.size();
 }
 
 bool IntelWeb::purge(const string& entity)
 {
+	if (!m_fileOpen)
+		return false;
+
 	bool purged = false;
 	DiskMultiMap::Iterator it;
-	for (it = forward.search(entity); it.isValid(); ++it)
+	m_graph.clear(); // interactions can't be taken out of it
+	beginBatch();
+	for (it = forwardShard(entity).search(entity); it.isValid(); ++it)
 	{
 		purged = true;
 		MultiMapTuple m = *it;
-		forward.erase(m.key, m.value, m.context);
-		reverse.erase(m.value, m.key, m.context);
+		eraseForward(m.key, m.value, m.context);
+		eraseReverse(m.value, m.key, m.context);
 		// Account for child-creating-parent situations
-		forward.erase(m.value, m.key, m.context);
-		reverse.erase(m.key, m.value, m.context);
+		eraseForward(m.value, m.key, m.context);
+		eraseReverse(m.key, m.value, m.context);
 	}
-	for (it = reverse.search(entity); it.isValid(); ++it)
+	for (it = reverseShard(entity).search(entity); it.isValid(); ++it)
 	{
 		purged = true;
 		MultiMapTuple m = *it;
-		reverse.erase(m.key, m.value, m.context);
-		forward.erase(m.value, m.key, m.context);
+		eraseReverse(m.key, m.value, m.context);
+		eraseForward(m.value, m.key, m.context);
 		// Account for child-creating-parent situations
-		reverse.erase(m.value, m.key, m.context);
-		forward.erase(m.key, m.value, m.context);
+		eraseReverse(m.value, m.key, m.context);
+		eraseForward(m.key, m.value, m.context);
 	}
+	commitBatch(); // the sketch is written by the next ingest() or by close()
 	return purged;
 }
 
+bool IntelWeb::loadGraph()
+{
+	if (!m_fileOpen)
+		return false;
+
+	// Every interaction is in the forward tables exactly once
+	m_graph.clear();
+	vector<MultiMapTuple> tuples;
+	for (size_t shard = 0; shard < forward.size(); ++shard)
+		for (unsigned int bucket = 0; bucket < forward[shard]->numBuckets(); ++bucket)
+		{
+			if (!forward[shard]->scanBucket(bucket, tuples))
+			{
+				m_graph.clear();
+				return false;
+			}
+			for (size_t i = 0; i < tuples.size(); ++i)
+				m_graph.addInteraction(tuples[i].key, tuples[i].value, tuples[i].context);
+		}
+	m_graph.build();
+	return true;
+}
+
+void IntelWeb::unloadGraph()
+{
+	m_graph.clear();
+}
+
+void IntelWeb::setApproximatePrevalence(bool approximate)
+{
+	m_approximatePrevalence = approximate;
+}
+
+bool IntelWeb::search(const string& entity, vector<InteractionTuple>& interactions)
+{
+	interactions.clear();
+	if (!m_fileOpen)
+		return false;
+	lookupInteractions(entity, chrono::steady_clock::time_point::max(), interactions);
+	return !interactions.empty();
+}
+
+unsigned int IntelWeb::prevalence(const string& entity, unsigned int cap)
+{
+	if (!m_fileOpen)
+		return 0;
+
+	if (m_sharingLookups)
+	{
+		map<string, vector<InteractionTuple> >::const_iterator found = m_sharedInteractions.find(entity);
+		if (found != m_sharedInteractions.end())
+			return static_cast<unsigned int>(min<size_t>(found->second.size(), cap));
+		// A count that stopped at its cap only tells us the prevalence is at least that
+		map<string, pair<unsigned int, unsigned int> >::const_iterator counted = m_sharedPrevalences.find(entity);
+		if (counted != m_sharedPrevalences.end()
+			&& (counted->second.first < counted->second.second || cap <= counted->second.second))
+			return min(counted->second.first, cap);
+	}
+
+	DiskMultiMap::Iterator it;
+	unsigned int i = 0;
+	for (it = forwardShard(entity).search(entity); it.isValid() && i < cap; ++it)
+		++i;
+	for (it = reverseShard(entity).search(entity); it.isValid() && i < cap; ++it)
+		++i;
+	if (m_sharingLookups)
+		m_sharedPrevalences[entity] = make_pair(i, cap);
+	return i;
+}
+
+void IntelWeb::beginSharedLookups()
+{
+	m_sharingLookups = true;
+}
+
+void IntelWeb::endSharedLookups()
+{
+	m_sharingLookups = false;
+	forgetSharedLookups();
+}
+
+bool IntelWeb::findEntities(const string& pattern, vector<string>& entities)
+{
+	entities.clear();
+	if (!m_fileOpen || !m_index.isOpen() || pattern.empty())
+		return false;
+
+	vector<string> candidates;
+	if (pattern.compare(0, 2, "*.") == 0)
+		m_index.findByDomainSuffix(pattern.substr(2), candidates);
+	else if (pattern[pattern.size() - 1] == '*')
+		m_index.findByPrefix(pattern.substr(0, pattern.size() - 1), candidates);
+	else
+		candidates.push_back(pattern);
+
+	// The index still lists purged entities
+	for (size_t i = 0; i < candidates.size(); ++i)
+		if (prevalence(candidates[i], 1) > 0)
+			entities.push_back(candidates[i]);
+	return !entities.empty();
+}
+
+bool IntelWeb::findEntitiesInRange(const string& first, const string& last, vector<string>& entities)
+{
+	entities.clear();
+	if (!m_fileOpen || !m_index.isOpen())
+		return false;
+
+	vector<string> candidates;
+	m_index.findInRange(first, last, candidates);
+	for (size_t i = 0; i < candidates.size(); ++i)
+		if (prevalence(candidates[i], 1) > 0)
+			entities.push_back(candidates[i]);
+	return !entities.empty();
+}
+
+unsigned int IntelWeb::crawlPattern(const string& pattern,
+	unsigned int minPrevalenceToBeGood,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions)
+{
+	vector<string> indicators;
+	findEntities(pattern, indicators);
+	return crawl(indicators, minPrevalenceToBeGood, badEntitiesFound, badInteractions);
+}
+
 
 /////////////////////////////////
 //	Helper Functions
 /////////////////////////////////
 
+bool IntelWeb::parseLine(const string& line, InteractionTuple& interaction)
+{
+	istringstream iss(line);
+	return static_cast<bool>(iss >> interaction.context >> interaction.from >> interaction.to);
+}
+
+unique_ptr<istream> IntelWeb::openTelemetryFile(const string& telemetryFile)
+{
+	return unique_ptr<istream>(new ifstream(telemetryFile));
+}
+
+void IntelWeb::parseStreams(const vector<StreamFactory>& telemetryStreams, IngestQueue& queue)
+{
+	bool cancelled = false;
+	while (!cancelled)
+	{
+		size_t stream;
+		{
+			lock_guard<mutex> lock(queue.m_mutex);
+			if (queue.m_cancelled || queue.m_nextStream == telemetryStreams.size())
+				break;
+			stream = queue.m_nextStream++;
+		}
+
+		unique_ptr<istream> in = telemetryStreams[stream]();
+		if (!in || !*in)
+		{
+			lock_guard<mutex> lock(queue.m_mutex);
+			queue.m_allOpened = false;
+			continue;
+		}
+
+		vector<InteractionTuple> chunk;
+		string line;
+		InteractionTuple t;
+		bool more = true;
+		while (more && !cancelled)
+		{
+			more = static_cast<bool>(getline(*in, line));
+			if (more && parseLine(line, t))
+				chunk.push_back(t);
+			if (chunk.size() < INGEST_BATCH_SIZE && (more || chunk.empty()))
+				continue;
+
+			// Hand the chunk over, waiting for room in the queue
+			unique_lock<mutex> lock(queue.m_mutex);
+			while (queue.m_chunks.size() >= INGEST_QUEUE_CHUNKS && !queue.m_cancelled)
+				queue.m_changed.wait(lock);
+			cancelled = queue.m_cancelled;
+			if (!cancelled)
+			{
+				queue.m_chunks.push_back(vector<InteractionTuple>());
+				queue.m_chunks.back().swap(chunk);
+				queue.m_changed.notify_all();
+			}
+		}
+		if (!cancelled && (!in->eof() || in->bad()))
+		{
+			lock_guard<mutex> lock(queue.m_mutex);
+			queue.m_allRead = false; // the stream failed before its end
+		}
+	}
+
+	lock_guard<mutex> lock(queue.m_mutex);
+	queue.m_workersLeft--;
+	queue.m_changed.notify_all();
+}
+
+bool IntelWeb::insertInteractions(const vector<InteractionTuple>& interactions)
+{
+	forgetSharedLookups(); // the store is about to change
+	// Route every interaction to the shards owning its two keys
+	vector<vector<const InteractionTuple*> > forwardWork(forward.size()), reverseWork(reverse.size());
+	for (size_t i = 0; i < interactions.size(); ++i)
+	{
+		forwardWork[shardOf(interactions[i].from)].push_back(&interactions[i]);
+		reverseWork[shardOf(interactions[i].to)].push_back(&interactions[i]);
+		trackInteraction(interactions[i]);
+	}
+	if (forward.size() == 1)
+		return insertIntoShard(0, forwardWork[0], reverseWork[0]);
+
+	// One thread per shard writes that shard's forward and reverse tables,
+	// so no two threads ever share a DiskMultiMap.
+	vector<future<bool> > writers;
+	for (size_t s = 0; s < forward.size(); ++s)
+		writers.push_back(async(launch::async, &IntelWeb::insertIntoShard, this, s,
+			cref(forwardWork[s]), cref(reverseWork[s])));
+	bool inserted = true;
+	for (size_t s = 0; s < writers.size(); ++s)
+		if (!writers[s].get())
+			inserted = false;
+	return inserted;
+}
+
+bool IntelWeb::insertIntoShard(size_t shard, const vector<const InteractionTuple*>& forwardWork,
+	const vector<const InteractionTuple*>& reverseWork)
+{
+	DiskMultiMap& f = *forward[shard];
+	DiskMultiMap& r = *reverse[shard];
+	bool inserted = true;
+	for (size_t i = 0; i < forwardWork.size() && inserted; i += INGEST_BATCH_SIZE)
+	{
+		f.beginBatch();
+		for (size_t j = i; j < forwardWork.size() && j < i + INGEST_BATCH_SIZE && inserted; ++j)
+			inserted = f.insert(forwardWork[j]->from, forwardWork[j]->to, forwardWork[j]->context);
+		inserted = f.commitBatch() && inserted;
+	}
+	for (size_t i = 0; i < reverseWork.size() && inserted; i += INGEST_BATCH_SIZE)
+	{
+		r.beginBatch();
+		for (size_t j = i; j < reverseWork.size() && j < i + INGEST_BATCH_SIZE && inserted; ++j)
+			inserted = r.insert(reverseWork[j]->to, reverseWork[j]->from, reverseWork[j]->context);
+		inserted = r.commitBatch() && inserted;
+	}
+	return inserted;
+}
+
+bool IntelWeb::lookupInteractions(const string& entity, const chrono::steady_clock::time_point& deadline,
+	vector<InteractionTuple>& interactions)
+{
+	if (m_sharingLookups)
+	{
+		map<string, vector<InteractionTuple> >::const_iterator found = m_sharedInteractions.find(entity);
+		if (found != m_sharedInteractions.end())
+		{
+			interactions = found->second;
+			return true;
+		}
+	}
+
+	// Forward entries first, then reverse, checking the deadline every so often
+	// since a popular entity can have a very long chain
+	interactions.clear();
+	unsigned int sinceCheck = 0;
+	for (int table = 0; table < 2; ++table)
+	{
+		DiskMultiMap& tableShard = table == 0 ? forwardShard(entity) : reverseShard(entity);
+		for (DiskMultiMap::Iterator it = tableShard.search(entity); it.isValid(); ++it)
+		{
+			if (++sinceCheck == CRAWL_DEADLINE_CHECK_INTERVAL)
+			{
+				sinceCheck = 0;
+				if (chrono::steady_clock::now() >= deadline)
+					return false;
+			}
+			interactions.push_back(toInteractionTuple(*it, table == 0));
+		}
+	}
+	if (m_sharingLookups)
+		m_sharedInteractions[entity] = interactions;
+	return true;
+}
+
+void IntelWeb::forgetSharedLookups()
+{
+	m_sharedInteractions.clear();
+	m_sharedPrevalences.clear();
+}
+
+void IntelWeb::beginBatch()
+{
+	forgetSharedLookups(); // the store is about to change
+	for (size_t s = 0; s < forward.size(); ++s)
+	{
+		forward[s]->beginBatch();
+		reverse[s]->beginBatch();
+	}
+}
+
+bool IntelWeb::commitBatch()
+{
+	bool committed = true;
+	for (size_t s = 0; s < forward.size(); ++s)
+	{
+		committed = forward[s]->commitBatch() && committed;
+		committed = reverse[s]->commitBatch() && committed;
+	}
+	return committed;
+}
+
 bool IntelWeb::prevalenceUnderThreshold(const string& key, unsigned int threshold)
 {
-	DiskMultiMap::Iterator it;
-	unsigned int i = 0;
-	for (it = forward.search(key); it.isValid(); ++it, ++i)
-		if (i >= threshold)
-			return false;
-	for (it = reverse.search(key); it.isValid(); ++it, ++i)
-		if (i >= threshold)
+	if (m_approximatePrevalence && m_sketch.isOpen())
+	{
+		// The sketch never undercounts, so a low estimate settles it. A high one only
+		// does if it is high even after taking off the most the sketch (very likely)
+		// overcounts by; anything in between needs an exact count.
+		unsigned int estimate = m_sketch.estimate(key);
+		if (estimate < threshold)
+			return true;
+		if (estimate >= static_cast<uint64_t>(threshold) + m_sketch.errorBound())
 			return false;
-	return i >= threshold ? false : true;
+	}
+	return prevalence(key, threshold) < threshold;
+}
+
+void IntelWeb::trackInteraction(const InteractionTuple& t)
+{
+	// An entity's prevalence is its number of forward plus reverse entries
+	m_sketch.add(t.from);
+	m_sketch.add(t.to);
+	if (m_index.isOpen())
+	{
+		m_index.add(t.from);
+		m_index.add(t.to);
+	}
+	if (m_graph.isBuilt())
+		m_graph.addInteraction(t.from, t.to, t.context);
+}
+
+bool IntelWeb::rebuildTracking(const string& sketchName, const string& indexName)
+{
+	// The sketch is sized the way createNew() sized it, by the number of buckets
+	if (!sketchName.empty() && !m_sketch.createNew(sketchName,
+		CountMinSketch::widthFor(static_cast<unsigned long long>(forward[0]->numBuckets()) * forward.size())))
+		return false;
+	if (!indexName.empty() && !m_index.createNew(indexName))
+		return false;
+
+	// An entity's prevalence is its number of forward plus reverse entries, and
+	// every entity is the key of at least one of them
+	vector<MultiMapTuple> tuples;
+	for (int table = 0; table < 2; ++table)
+		for (size_t shard = 0; shard < forward.size(); ++shard)
+		{
+			DiskMultiMap& tableShard = table == 0 ? *forward[shard] : *reverse[shard];
+			for (unsigned int bucket = 0; bucket < tableShard.numBuckets(); ++bucket)
+			{
+				if (!tableShard.scanBucket(bucket, tuples))
+					return false;
+				for (size_t i = 0; i < tuples.size(); ++i)
+				{
+					if (!sketchName.empty())
+						m_sketch.add(tuples[i].key);
+					if (!indexName.empty())
+						m_index.add(tuples[i].key);
+				}
+			}
+		}
+	return (sketchName.empty() || m_sketch.flush()) && (indexName.empty() || m_index.flush());
+}
+
+bool IntelWeb::flushTracking()
+{
+	if (m_graph.isBuilt())
+		m_graph.build();
+	bool flushed = !m_sketch.isOpen() || m_sketch.flush();
+	return (!m_index.isOpen() || m_index.flush()) && flushed;
+}
+
+void IntelWeb::eraseForward(const string& key, const string& value, const string& context)
+{
+	m_sketch.add(key, -forwardShard(key).erase(key, value, context));
+}
+
+void IntelWeb::eraseReverse(const string& key, const string& value, const string& context)
+{
+	m_sketch.add(key, -reverseShard(key).erase(key, value, context));
+}
+
+size_t IntelWeb::shardOf(const string& key) const
+{
+	if (forward.size() == 1)
+		return 0;
+
+	// Scramble the hash before picking a shard, otherwise every key in a shard
+	// would land in the same few buckets of that shard's DiskMultiMap (which
+	// takes the plain hash modulo its bucket count).
+	uint64_t h = hash<string>()(key);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return static_cast<size_t>(h % forward.size());
+}
+
+DiskMultiMap& IntelWeb::forwardShard(const string& key)
+{
+	return *forward[shardOf(key)];
+}
+
+DiskMultiMap& IntelWeb::reverseShard(const string& key)
+{
+	return *reverse[shardOf(key)];
+}
+
+unsigned int IntelWeb::storedShardCount(const string& filePrefix)
+{
+	// Recorded by createNew(); a store without the record isn't one we can open
+	ifstream shards(filePrefix + "_shards.txt");
+	unsigned int numShards;
+	if (shards >> numShards)
+		return numShards;
+	return 0;
+}
+
+bool IntelWeb::removeShard(const string& filePrefix, unsigned int shard, unsigned int numShards)
+{
+	string forwardName = shardFileName(filePrefix, "forward", shard, numShards);
+	string reverseName = shardFileName(filePrefix, "reverse", shard, numShards);
+	bool removed = remove(forwardName.c_str()) == 0;
+	removed = remove(reverseName.c_str()) == 0 && removed;
+	remove((forwardName + ".journal").c_str()); // only there after a crash
+	remove((reverseName + ".journal").c_str());
+	return removed;
+}
+
+string IntelWeb::shardFileName(const string& filePrefix, const string& table,
+	unsigned int shard, unsigned int numShards)
+{
+	if (numShards == 1)
+		return filePrefix + "_" + table + "_hash_table.dat";
+	return filePrefix + "_" + table + "_hash_table_" + to_string(shard) + ".dat";
 }
 
 InteractionTuple IntelWeb::toInteractionTuple(const MultiMapTuple& m, bool forward)
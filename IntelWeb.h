@@ -3,6 +3,13 @@
 // and discovering new attacks by searching through this data structure. It can also
 // purge specific telemetry data items from its data structures.
 //
+// A store may be split into several hash-partitioned shards, each with its own forward
+// and reverse DiskMultiMap (filePrefix_forward_hash_table_N.dat and so on; a single
+// shard keeps the plain file names). Every key lives in exactly one shard, chosen by
+// hashing the key, so ingest can write all shards concurrently and every lookup during
+// crawl() or purge() goes straight to the one shard that owns the key. The number of
+// shards is recorded in filePrefix_shards.txt.
+//
 // In order to facilitate malicious entity discovery in both directions (ie. a known
 // malicious website downloading an unknown file would implicate the file, but also
 // an unknown website downloading a known malicious file would implicate the website!)
@@ -10,8 +17,16 @@
 // and one called reverse (ie. B is created by A, where B is the key) so that both the 
 // creator and the created can be discovered by searching our hash tables.
 //
+// removeStore() - deletes every file of a (closed) store. createNew() does this first.
 // ingest() - simply inserts all the data from a telemetry log file of the specified name
-//     into the appropriate disk-based data structures (DiskMultiMap).
+//     into the appropriate disk-based data structures (DiskMultiMap). It can also read from
+//     any input stream (eg. one that decompresses a gzip/zstd file on the fly, so nothing
+//     needs to be decompressed to disk first), or take a list of files or of StreamFactories
+//     (functions that open a stream, eg. a decompressing one, when called). The streams are
+//     then opened and parsed on worker threads, which hand the calling thread bounded chunks
+//     of interactions to insert into forward and reverse as they go. A stream that fails
+//     partway through (eg. a corrupt compressed block) makes ingest() return false, but the
+//     interactions read from it before the failure stay ingested.
 // crawl() - responsible for (a) discovering and outputting an ordered vector of all 
 //     malicious entities found in the previously-ingested telemetry, and (b) outputting
 //     an ordered vector of every interaction discovered that includes at least one
@@ -20,9 +35,47 @@
 //     search our forward and reverse hash tables. If the indicator is found, and the 
 //     associated entity with that indicator has not yet been tagged as a threat AND has a
 //     prevalence under our threshold, then we add that associated entity to our threat
-//     indicators queue. Loop until all threat indicators have been processed.
+//     indicators queue. Loop until all threat indicators have been processed. Given
+//     CrawlOptions (see CrawlOptions.h), crawl() stops early when it runs out of hops,
+//     entities, interactions or time, outputs what it has found so far, and sets
+//     stoppedBy to the budget that stopped it.
+// search() - outputs every ingested interaction the entity takes part in, either as the
+//     initiator (forward) or as the target (reverse).
+// prevalence() - the number of interactions the entity takes part in, counting stops at cap.
+// findEntities() - needs the optional ordered index (see OrderedIndex.h, created by passing
+//     orderedIndex to createNew()). Outputs every entity matching a pattern: "*.evil-cdn.net"
+//     finds the websites under a domain, "setup_*" the entities starting with "setup_", and
+//     anything else is looked up as is. findEntitiesInRange() outputs the entities in
+//     [first, last). crawlPattern() is crawl() seeded with the entities matching a pattern.
+//     Like the sketch below, an index with entities that never reached its files (eg.
+//     after a crash during ingest()) is built again from the hash tables by openExisting().
+// setApproximatePrevalence() - switches crawl() to approximate prevalence checks. IntelWeb
+//     keeps a count-min sketch of every entity's prevalence (see CountMinSketch.h) in
+//     filePrefix_prevalence_sketch.dat, as wide as the store has hash buckets (up to a
+//     limit) so that its error stays small as the store grows. It is updated by ingest()
+//     and purge() and written at the end of every ingest() and by close(). openExisting()
+//     builds the sketch again from the hash tables if it has changes that never reached
+//     its file. In approximate mode an entity whose estimate is clearly above
+//     minPrevalenceToBeGood is taken as good without reading the hash tables, so a popular
+//     entity costs no disk I/O. There is a small chance (about 2%) that such an entity is
+//     really just under the threshold. Entities close to the threshold still get an exact
+//     count.
+// loadGraph() - loads the whole store into memory as an IntelGraph (see IntelGraph.h), after
+//     which crawl() runs on the graph, without any disk I/O, and gives the same results.
+//     ingest() keeps a loaded graph up to date; purge() unloads it (call loadGraph() again
+//     afterwards). unloadGraph() frees the memory.
+// beginSharedLookups() - until endSharedLookups(), remembers what search() and prevalence()
+//     (and the lookups crawl() makes through them) read from the hash tables, so that a
+//     group of queries (eg. IntelWebServer's batch of requests) reads each entity only
+//     once. ingest() and purge() forget what was remembered.
 // purge() - used to remove all references to a specified entity (eg. a filename or website)
 //     from the IntelWeb disk-based data structures (forward and reverse DiskMultiMap).
+//
+// ingest() and purge() group their writes into DiskMultiMap batches (see DiskMultiMap.h),
+// so each batch reaches disk as one journaled, offset-ordered write pass. Every DiskMultiMap
+// journals its own part of a batch, so after a crash each table holds all or none of its
+// part, but the tables are not atomic with each other: forward (or one shard) may hold
+// interactions of the last batch that reverse (or another shard) lacks.
 
 #ifndef INTELWEB_H_
 #define INTELWEB_H_
@@ -34,33 +87,118 @@
 #endif // _MSC_VER
 
 #include "InteractionTuple.h"
+#include "CrawlOptions.h"
 #include "DiskMultiMap.h"
+#include "OrderedIndex.h"
+#include "CountMinSketch.h"
+#include "IntelGraph.h"
 #include <string>
 #include <vector>
+#include <map>
 #include <set>
+#include <istream>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <climits>
 
 class IntelWeb
 {
 public:
+	typedef std::function<std::unique_ptr<std::istream>()> StreamFactory;
+
 	IntelWeb();
 	~IntelWeb();
-	bool createNew(const std::string& filePrefix, unsigned int maxDataItems);
+	bool createNew(const std::string& filePrefix, unsigned int maxDataItems, unsigned int numShards = 1,
+		bool orderedIndex = false);
 	bool openExisting(const std::string& filePrefix);
 	void close();
+	static bool removeStore(const std::string& filePrefix);
 	bool ingest(const std::string& telemetryFile);
+	bool ingest(std::istream& telemetry);
+	bool ingest(const std::vector<std::string>& telemetryFiles);
+	bool ingest(const std::vector<StreamFactory>& telemetryStreams);
 	unsigned int crawl(const std::vector<std::string>& indicators,
 		unsigned int minPrevalenceToBeGood,
 		std::vector<std::string>& badEntitiesFound,
 		std::vector<InteractionTuple>& badInteractions);
+	unsigned int crawl(const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		const CrawlOptions& options,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions,
+		CrawlStop& stoppedBy);
 	bool purge(const std::string& entity);
+	bool loadGraph();
+	void unloadGraph();
+	void setApproximatePrevalence(bool approximate);
+	void beginSharedLookups();
+	void endSharedLookups();
+	bool search(const std::string& entity, std::vector<InteractionTuple>& interactions);
+	unsigned int prevalence(const std::string& entity, unsigned int cap = UINT_MAX);
+	bool findEntities(const std::string& pattern, std::vector<std::string>& entities);
+	bool findEntitiesInRange(const std::string& first, const std::string& last,
+		std::vector<std::string>& entities);
+	unsigned int crawlPattern(const std::string& pattern,
+		unsigned int minPrevalenceToBeGood,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions);
 
 private:
 	bool m_fileOpen;
-	DiskMultiMap forward;
-	DiskMultiMap reverse;
+	std::vector<std::unique_ptr<DiskMultiMap> > forward; // one per shard
+	std::vector<std::unique_ptr<DiskMultiMap> > reverse;
+	OrderedIndex m_index; // only open if the store was created with one
+	CountMinSketch m_sketch; // approximate prevalence of every entity
+	IntelGraph m_graph; // only built by loadGraph()
+	bool m_approximatePrevalence;
+
+	// search() and prevalence() results kept between beginSharedLookups() and
+	// endSharedLookups(); prevalences are (count, cap it was counted up to)
+	bool m_sharingLookups;
+	std::map<std::string, std::vector<InteractionTuple> > m_sharedInteractions;
+	std::map<std::string, std::pair<unsigned int, unsigned int> > m_sharedPrevalences;
+
+	// Parsed interactions on their way from the ingest workers to the inserting thread
+	struct IngestQueue
+	{
+		std::mutex m_mutex;
+		std::condition_variable m_changed;
+		std::deque<std::vector<InteractionTuple> > m_chunks;
+		size_t m_nextStream; // next stream for a worker to take
+		unsigned int m_workersLeft;
+		bool m_allOpened;
+		bool m_allRead; // no stream failed partway through
+		bool m_cancelled; // inserting failed, workers should stop
+	};
 	
 private:
+	static bool parseLine(const std::string& line, InteractionTuple& interaction);
+	static std::unique_ptr<std::istream> openTelemetryFile(const std::string& telemetryFile);
+	static void parseStreams(const std::vector<StreamFactory>& telemetryStreams, IngestQueue& queue);
+	bool insertInteractions(const std::vector<InteractionTuple>& interactions);
+	void trackInteraction(const InteractionTuple& t);
+	bool flushTracking();
+	bool rebuildTracking(const std::string& sketchName, const std::string& indexName);
+	void eraseForward(const std::string& key, const std::string& value, const std::string& context);
+	void eraseReverse(const std::string& key, const std::string& value, const std::string& context);
+	bool insertIntoShard(size_t shard, const std::vector<const InteractionTuple*>& forwardWork,
+		const std::vector<const InteractionTuple*>& reverseWork);
+	void beginBatch();
+	bool commitBatch();
+	size_t shardOf(const std::string& key) const;
+	DiskMultiMap& forwardShard(const std::string& key);
+	DiskMultiMap& reverseShard(const std::string& key);
+	static unsigned int storedShardCount(const std::string& filePrefix);
+	static bool removeShard(const std::string& filePrefix, unsigned int shard, unsigned int numShards);
+	static std::string shardFileName(const std::string& filePrefix, const std::string& table,
+		unsigned int shard, unsigned int numShards);
 	bool prevalenceUnderThreshold(const std::string& key, unsigned int threshold);
+	bool lookupInteractions(const std::string& entity, const std::chrono::steady_clock::time_point& deadline,
+		std::vector<InteractionTuple>& interactions);
+	void forgetSharedLookups();
 	InteractionTuple toInteractionTuple(const MultiMapTuple& m, bool forward);
 };
 
@@ -0,0 +1,57 @@
+// IntelWebDaemon is a long-running server that keeps IntelWeb stores open and answers
+// queries from IntelWebQuery (or any other IntelWebClient) over a Unix domain socket.
+//
+// Usage: IntelWebDaemon [-t crawlTimeLimitMilliseconds] socketPath storeName=filePrefix [storeName=filePrefix ...]
+//
+// With -t, no crawl runs longer than that, whatever time limit its request asks for.
+
+#include "IntelWebServer.h"
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+IntelWebServer server;
+
+void stopServer(int)
+{
+	server.stop();
+}
+
+int main(int argc, char* argv[])
+{
+	int first = 1; // first argument after the options
+	if (argc > 2 && strcmp(argv[1], "-t") == 0)
+	{
+		server.setCrawlTimeLimit(strtoul(argv[2], nullptr, 10));
+		first = 3;
+	}
+	if (argc < first + 2)
+	{
+		cerr << "Usage: " << argv[0] << " [-t crawlTimeLimitMilliseconds] socketPath storeName=filePrefix [storeName=filePrefix ...]" << endl;
+		return 1;
+	}
+
+	for (int i = first + 1; i < argc; ++i)
+	{
+		string store = argv[i];
+		size_t equals = store.find('=');
+		if (equals == string::npos || !server.addStore(store.substr(0, equals), store.substr(equals + 1)))
+		{
+			cerr << "Cannot open store " << store << endl;
+			return 1;
+		}
+	}
+	if (!server.listen(argv[first]))
+	{
+		cerr << "Cannot listen on " << argv[first] << endl;
+		return 1;
+	}
+
+	signal(SIGINT, stopServer);
+	signal(SIGTERM, stopServer);
+	bool served = server.serve();
+	server.close();
+	return served ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// IntelWebQuery sends one query to a running IntelWebDaemon and prints the answer.
+//
+// Usage: IntelWebQuery socketPath storeName crawl minPrevalenceToBeGood indicator [indicator ...]
+//        IntelWebQuery socketPath storeName search entity
+//        IntelWebQuery socketPath storeName prevalence entity
+
+#include "IntelWebServer.h"
+#include <cstdlib>
+#include <iostream>
+using namespace std;
+
+void printInteractions(const vector<InteractionTuple>& interactions)
+{
+	for (size_t i = 0; i < interactions.size(); ++i)
+		cout << interactions[i].context << " " << interactions[i].from << " " << interactions[i].to << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 5)
+	{
+		cerr << "Usage: " << argv[0] << " socketPath storeName crawl minPrevalenceToBeGood indicator [indicator ...]" << endl
+			<< "       " << argv[0] << " socketPath storeName search entity" << endl
+			<< "       " << argv[0] << " socketPath storeName prevalence entity" << endl;
+		return 1;
+	}
+
+	IntelWebClient client;
+	if (!client.connect(argv[1]))
+	{
+		cerr << "Cannot connect to " << argv[1] << endl;
+		return 1;
+	}
+
+	string store = argv[2], command = argv[3];
+	bool answered = false;
+	if (command == "crawl" && argc >= 6)
+	{
+		vector<string> indicators(argv + 5, argv + argc), badEntitiesFound;
+		vector<InteractionTuple> badInteractions;
+		unsigned int count;
+		answered = client.crawl(store, indicators, strtoul(argv[4], nullptr, 10),
+			badEntitiesFound, badInteractions, count);
+		if (answered)
+		{
+			cout << count << " malicious entities found" << endl;
+			for (size_t i = 0; i < badEntitiesFound.size(); ++i)
+				cout << badEntitiesFound[i] << endl;
+			printInteractions(badInteractions);
+		}
+	}
+	else if (command == "search")
+	{
+		vector<InteractionTuple> interactions;
+		answered = client.search(store, argv[4], interactions);
+		if (answered)
+			printInteractions(interactions);
+	}
+	else if (command == "prevalence")
+	{
+		unsigned int prevalence;
+		answered = client.prevalence(store, argv[4], prevalence);
+		if (answered)
+			cout << prevalence << endl;
+	}
+	else
+	{
+		cerr << "Unknown command " << command << endl;
+		return 1;
+	}
+
+	if (!answered)
+	{
+		cerr << "Query failed" << endl;
+		return 1;
+	}
+	return 0;
+}
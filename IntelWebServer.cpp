@@ -0,0 +1,584 @@
+#include "IntelWebServer.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using namespace std;
+
+namespace
+{
+	enum Operation { CRAWL = 1, SEARCH = 2, PREVALENCE = 3 };
+	enum Status { STATUS_OK = 0, STATUS_ERROR = 1 };
+
+	const uint32_t MAX_FRAME = 64 * 1024 * 1024; // refuse anything bigger than this
+	const size_t MAX_OUTBOX = 16 * 1024 * 1024; // stop reading from a client this far behind
+
+	// Appends protocol values to a payload
+	class Writer
+	{
+	public:
+		void u8(uint8_t v) { m_buf.push_back(static_cast<char>(v)); }
+		void u32(uint32_t v) { m_buf.append(reinterpret_cast<const char*>(&v), sizeof(v)); }
+		void str(const string& s)
+		{
+			uint16_t length = static_cast<uint16_t>(s.size());
+			m_buf.append(reinterpret_cast<const char*>(&length), sizeof(length));
+			m_buf.append(s, 0, length);
+		}
+		void strings(const vector<string>& v)
+		{
+			u32(static_cast<uint32_t>(v.size()));
+			for (size_t i = 0; i < v.size(); ++i)
+				str(v[i]);
+		}
+		void interactions(const vector<InteractionTuple>& v)
+		{
+			u32(static_cast<uint32_t>(v.size()));
+			for (size_t i = 0; i < v.size(); ++i)
+			{
+				str(v[i].from);
+				str(v[i].to);
+				str(v[i].context);
+			}
+		}
+		const string& payload() const { return m_buf; }
+
+	private:
+		string m_buf;
+	};
+
+	// Reads protocol values back out of a payload. Once anything runs past the
+	// end of the payload, ok() is false and every later read returns zero/empty.
+	class Reader
+	{
+	public:
+		Reader(const string& buf) : m_buf(buf), m_pos(0), m_ok(true) {}
+		bool ok() const { return m_ok; }
+		uint8_t u8()
+		{
+			uint8_t v = 0;
+			get(&v, sizeof(v));
+			return v;
+		}
+		uint32_t u32()
+		{
+			uint32_t v = 0;
+			get(&v, sizeof(v));
+			return v;
+		}
+		string str()
+		{
+			uint16_t length = 0;
+			if (!get(&length, sizeof(length)) || m_pos + length > m_buf.size())
+			{
+				m_ok = false;
+				return "";
+			}
+			m_pos += length;
+			return m_buf.substr(m_pos - length, length);
+		}
+		bool strings(vector<string>& v)
+		{
+			uint32_t n = u32();
+			for (uint32_t i = 0; i < n && m_ok; ++i)
+				v.push_back(str());
+			return m_ok;
+		}
+		bool interactions(vector<InteractionTuple>& v)
+		{
+			uint32_t n = u32();
+			for (uint32_t i = 0; i < n && m_ok; ++i)
+			{
+				InteractionTuple t;
+				t.from = str();
+				t.to = str();
+				t.context = str();
+				v.push_back(t);
+			}
+			return m_ok;
+		}
+
+	private:
+		bool get(void* data, size_t length)
+		{
+			if (!m_ok || m_pos + length > m_buf.size())
+				return m_ok = false;
+			memcpy(data, m_buf.data() + m_pos, length);
+			m_pos += length;
+			return true;
+		}
+
+		const string& m_buf;
+		size_t m_pos;
+		bool m_ok;
+	};
+
+	bool sendAll(int fd, const char* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				return false;
+			data += sent;
+			length -= sent;
+		}
+		return true;
+	}
+
+	bool recvAll(int fd, char* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t received = recv(fd, data, length, 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				return false;
+			data += received;
+			length -= received;
+		}
+		return true;
+	}
+
+	string frame(const string& payload)
+	{
+		uint32_t length = static_cast<uint32_t>(payload.size());
+		return string(reinterpret_cast<const char*>(&length), sizeof(length)) + payload;
+	}
+
+	bool sendFrame(int fd, const string& payload)
+	{
+		string f = frame(payload);
+		return sendAll(fd, f.data(), f.size());
+	}
+
+	bool recvFrame(int fd, string& payload)
+	{
+		uint32_t length;
+		if (!recvAll(fd, reinterpret_cast<char*>(&length), sizeof(length)) || length > MAX_FRAME)
+			return false;
+		payload.resize(length);
+		return length == 0 || recvAll(fd, &payload[0], length);
+	}
+
+	bool toAddress(const string& socketPath, sockaddr_un& address)
+	{
+		if (socketPath.size() >= sizeof(address.sun_path))
+			return false;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, socketPath.c_str());
+		return true;
+	}
+
+	string errorResponse()
+	{
+		Writer w;
+		w.u8(STATUS_ERROR);
+		return w.payload();
+	}
+}
+
+
+/////////////////////////////////
+//	IntelWebServer
+/////////////////////////////////
+
+IntelWebServer::IntelWebServer()
+	: m_listenFd(-1), m_crawlTimeLimit(0), m_running(0) {}
+
+IntelWebServer::~IntelWebServer()
+{
+	close();
+}
+
+bool IntelWebServer::addStore(const string& name, const string& filePrefix)
+{
+	if (m_stores.count(name))
+		return false;
+	unique_ptr<IntelWeb> store(new IntelWeb);
+	if (!store->openExisting(filePrefix))
+		return false;
+	m_stores[name] = move(store);
+	return true;
+}
+
+bool IntelWebServer::listen(const string& socketPath)
+{
+	sockaddr_un address;
+	if (m_listenFd >= 0 || !toAddress(socketPath, address))
+		return false;
+
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listenFd < 0)
+		return false;
+	unlink(socketPath.c_str()); // left behind by a server that was killed
+	if (bind(m_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+		|| ::listen(m_listenFd, SOMAXCONN) < 0)
+	{
+		::close(m_listenFd);
+		m_listenFd = -1;
+		return false;
+	}
+	m_socketPath = socketPath;
+	return true;
+}
+
+void IntelWebServer::setCrawlTimeLimit(unsigned int milliseconds)
+{
+	m_crawlTimeLimit = milliseconds;
+}
+
+bool IntelWebServer::serve()
+{
+	if (m_listenFd < 0)
+		return false;
+
+	m_running = 1;
+	while (m_running)
+	{
+		// Wait up to a second, so stop() is noticed even when nobody is talking to us
+		vector<pollfd> fds(1 + m_clients.size());
+		fds[0].fd = m_listenFd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < m_clients.size(); ++i)
+		{
+			// A client that doesn't read its answers gets no more requests read until
+			// it catches up, so its backlog can't grow without bound.
+			size_t backlog = m_clients[i].outbox.size() - m_clients[i].outboxSent;
+			fds[i + 1].fd = m_clients[i].fd;
+			fds[i + 1].events = (backlog < MAX_OUTBOX ? POLLIN : 0) | (backlog > 0 ? POLLOUT : 0);
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		// Read whatever the clients sent and cut it into complete request frames
+		vector<pair<size_t, string> > requests;
+		vector<bool> closed(m_clients.size(), false);
+		for (size_t i = 0; i < m_clients.size(); ++i)
+		{
+			if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) || !(fds[i + 1].events & POLLIN))
+				continue;
+			char buf[64 * 1024];
+			ssize_t received = recv(m_clients[i].fd, buf, sizeof(buf), 0);
+			if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				continue;
+			if (received <= 0)
+			{
+				closed[i] = true;
+				continue;
+			}
+
+			string& inbox = m_clients[i].inbox;
+			inbox.append(buf, received);
+			uint32_t length;
+			while (inbox.size() >= sizeof(length))
+			{
+				memcpy(&length, inbox.data(), sizeof(length));
+				if (length > MAX_FRAME)
+				{
+					closed[i] = true;
+					break;
+				}
+				if (inbox.size() < sizeof(length) + length)
+					break;
+				requests.push_back(make_pair(i, inbox.substr(sizeof(length), length)));
+				inbox.erase(0, sizeof(length) + length);
+			}
+		}
+
+		handleBatch(requests);
+
+		// Send what each client can take right now; the rest waits for POLLOUT
+		for (size_t i = 0; i < m_clients.size(); ++i)
+			if (!closed[i] && !flushOutbox(m_clients[i]))
+				closed[i] = true;
+
+		for (size_t i = closed.size(); i-- > 0; )
+			if (closed[i])
+			{
+				::close(m_clients[i].fd);
+				m_clients.erase(m_clients.begin() + i);
+			}
+
+		if (fds[0].revents & POLLIN)
+		{
+			Connection c;
+			c.fd = accept(m_listenFd, nullptr, nullptr);
+			c.outboxSent = 0;
+			if (c.fd >= 0 && fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK) == 0)
+				m_clients.push_back(c);
+			else if (c.fd >= 0)
+				::close(c.fd);
+		}
+	}
+	return true;
+}
+
+void IntelWebServer::stop()
+{
+	m_running = 0; // safe to call from a signal handler
+}
+
+void IntelWebServer::close()
+{
+	for (size_t i = 0; i < m_clients.size(); ++i)
+		::close(m_clients[i].fd);
+	m_clients.clear();
+	if (m_listenFd >= 0)
+	{
+		::close(m_listenFd);
+		unlink(m_socketPath.c_str());
+		m_listenFd = -1;
+	}
+	m_stores.clear();
+}
+
+void IntelWebServer::handleBatch(const vector<pair<size_t, string> >& requests)
+{
+	if (requests.empty())
+		return;
+
+	// Identical requests in the same batch share one answer, and all of them
+	// share whatever they read from the stores
+	chrono::steady_clock::time_point received = chrono::steady_clock::now();
+	map<string, unique_ptr<IntelWeb> >::iterator store;
+	for (store = m_stores.begin(); store != m_stores.end(); ++store)
+		store->second->beginSharedLookups();
+	map<string, string> answered;
+	for (size_t i = 0; i < requests.size(); ++i)
+	{
+		map<string, string>::iterator it = answered.find(requests[i].second);
+		if (it == answered.end())
+			it = answered.insert(make_pair(requests[i].second, frame(handleRequest(requests[i].second, received)))).first;
+		m_clients[requests[i].first].outbox += it->second;
+	}
+	for (store = m_stores.begin(); store != m_stores.end(); ++store)
+		store->second->endSharedLookups();
+}
+
+bool IntelWebServer::flushOutbox(Connection& c)
+{
+	while (c.outboxSent < c.outbox.size())
+	{
+		ssize_t sent = send(c.fd, c.outbox.data() + c.outboxSent, c.outbox.size() - c.outboxSent, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break; // the client's socket buffer is full
+		if (sent <= 0)
+			return false;
+		c.outboxSent += sent;
+	}
+	if (c.outboxSent == c.outbox.size() || c.outboxSent > c.outbox.size() / 2)
+	{
+		c.outbox.erase(0, c.outboxSent); // don't let sent bytes pile up
+		c.outboxSent = 0;
+	}
+	return true;
+}
+
+string IntelWebServer::handleRequest(const string& request, chrono::steady_clock::time_point received)
+{
+	Reader r(request);
+	uint8_t operation = r.u8();
+	string storeName = r.str();
+	map<string, unique_ptr<IntelWeb> >::iterator store = m_stores.find(storeName);
+	if (!r.ok() || store == m_stores.end())
+		return errorResponse();
+
+	Writer w;
+	switch (operation)
+	{
+	case CRAWL:
+	{
+		unsigned int minPrevalenceToBeGood = r.u32();
+		CrawlOptions options;
+		options.maxDepth = r.u32();
+		options.maxEntities = r.u32();
+		options.maxInteractions = r.u32();
+		unsigned int timeLimit = r.u32();
+		vector<string> indicators, badEntitiesFound;
+		vector<InteractionTuple> badInteractions;
+		if (!r.strings(indicators))
+			return errorResponse();
+
+		// The tighter of the request's time limit and ours
+		if (m_crawlTimeLimit != 0 && (timeLimit == 0 || timeLimit > m_crawlTimeLimit))
+			timeLimit = m_crawlTimeLimit;
+		if (timeLimit != 0)
+			options.deadline = received + chrono::milliseconds(timeLimit);
+		CrawlStop stoppedBy;
+		unsigned int count = store->second->crawl(indicators, minPrevalenceToBeGood, options,
+			badEntitiesFound, badInteractions, stoppedBy);
+		w.u8(STATUS_OK);
+		w.u8(static_cast<uint8_t>(stoppedBy));
+		w.u32(count);
+		w.strings(badEntitiesFound);
+		w.interactions(badInteractions);
+		break;
+	}
+	case SEARCH:
+	{
+		string entity = r.str();
+		vector<InteractionTuple> interactions;
+		if (!r.ok())
+			return errorResponse();
+		store->second->search(entity, interactions);
+		w.u8(STATUS_OK);
+		w.interactions(interactions);
+		break;
+	}
+	case PREVALENCE:
+	{
+		string entity = r.str();
+		if (!r.ok())
+			return errorResponse();
+		w.u8(STATUS_OK);
+		w.u32(store->second->prevalence(entity));
+		break;
+	}
+	default:
+		return errorResponse();
+	}
+	return w.payload();
+}
+
+
+/////////////////////////////////
+//	IntelWebClient
+/////////////////////////////////
+
+IntelWebClient::IntelWebClient()
+	: m_fd(-1) {}
+
+IntelWebClient::~IntelWebClient()
+{
+	close();
+}
+
+bool IntelWebClient::connect(const string& socketPath)
+{
+	close();
+	sockaddr_un address;
+	if (!toAddress(socketPath, address))
+		return false;
+	m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_fd < 0)
+		return false;
+	if (::connect(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void IntelWebClient::close()
+{
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+bool IntelWebClient::crawl(const string& store, const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions,
+	unsigned int& count)
+{
+	CrawlStop stoppedBy;
+	return crawl(store, indicators, minPrevalenceToBeGood, CrawlOptions(), badEntitiesFound,
+		badInteractions, count, stoppedBy);
+}
+
+bool IntelWebClient::crawl(const string& store, const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	const CrawlOptions& options,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions,
+	unsigned int& count,
+	CrawlStop& stoppedBy)
+{
+	badEntitiesFound.clear();
+	badInteractions.clear();
+
+	// The deadline is sent as the time left until it (rounded up, so a deadline
+	// in the near future isn't sent as "no limit")
+	uint32_t timeLimit = 0;
+	if (options.deadline != chrono::steady_clock::time_point::max())
+	{
+		chrono::steady_clock::duration left = options.deadline - chrono::steady_clock::now();
+		long long milliseconds = chrono::duration_cast<chrono::milliseconds>(left).count() + 1;
+		timeLimit = static_cast<uint32_t>(milliseconds < 1 ? 1 : milliseconds > UINT32_MAX ? UINT32_MAX : milliseconds);
+	}
+
+	Writer w;
+	w.u8(CRAWL);
+	w.str(store);
+	w.u32(minPrevalenceToBeGood);
+	w.u32(options.maxDepth);
+	w.u32(options.maxEntities);
+	w.u32(options.maxInteractions);
+	w.u32(timeLimit);
+	w.strings(indicators);
+
+	string response;
+	if (!call(w.payload(), response))
+		return false;
+	Reader r(response);
+	if (r.u8() != STATUS_OK)
+		return false;
+	stoppedBy = static_cast<CrawlStop>(r.u8());
+	count = r.u32();
+	return r.strings(badEntitiesFound) && r.interactions(badInteractions);
+}
+
+bool IntelWebClient::search(const string& store, const string& entity,
+	vector<InteractionTuple>& interactions)
+{
+	interactions.clear();
+	Writer w;
+	w.u8(SEARCH);
+	w.str(store);
+	w.str(entity);
+
+	string response;
+	if (!call(w.payload(), response))
+		return false;
+	Reader r(response);
+	return r.u8() == STATUS_OK && r.interactions(interactions);
+}
+
+bool IntelWebClient::prevalence(const string& store, const string& entity, unsigned int& prevalence)
+{
+	Writer w;
+	w.u8(PREVALENCE);
+	w.str(store);
+	w.str(entity);
+
+	string response;
+	if (!call(w.payload(), response))
+		return false;
+	Reader r(response);
+	if (r.u8() != STATUS_OK)
+		return false;
+	prevalence = r.u32();
+	return r.ok();
+}
+
+bool IntelWebClient::call(const string& request, string& response)
+{
+	return m_fd >= 0 && sendFrame(m_fd, request) && recvFrame(m_fd, response);
+}
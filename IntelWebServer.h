@@ -0,0 +1,108 @@
+// IntelWebServer keeps one or more IntelWeb stores open for as long as it runs, so their
+// files (and the OS page cache behind them) stay warm from one query to the next, and
+// answers crawl, search and prevalence requests sent over a Unix domain socket.
+// IntelWebClient is the other end of the socket. (POSIX only.)
+//
+// Every message, in either direction, is a frame: a uint32_t payload length followed by
+// the payload. Integers are sent in host byte order (both ends are on the same machine),
+// strings as a uint16_t length followed by the characters, and lists as a uint32_t count
+// followed by the items. A request payload is:
+//   - uint8_t operation (CRAWL, SEARCH or PREVALENCE) and the name of the store, then
+//       - CRAWL: uint32_t minPrevalenceToBeGood, uint32_t maxDepth, uint32_t maxEntities,
+//           uint32_t maxInteractions (see CrawlOptions.h), uint32_t time limit in
+//           milliseconds (0 for none), list of indicators
+//       - SEARCH: the entity
+//       - PREVALENCE: the entity
+// and a response payload is a uint8_t status (STATUS_OK or STATUS_ERROR), then if STATUS_OK:
+//       - CRAWL: uint8_t CrawlStop, uint32_t count, list of bad entities, list of interactions
+//       - SEARCH: list of interactions
+//       - PREVALENCE: uint32_t prevalence
+// where each interaction is three strings (from, to, context).
+//
+// The server is single threaded. Each time poll() wakes it up it reads everything the
+// clients have sent, then answers that whole batch of requests together: byte-identical
+// requests (eg. many analysts checking the same indicator) are answered only once, and
+// the rest share their lookups (see IntelWeb::beginSharedLookups()), so two crawls that
+// meet at an entity only read it from disk once. A crawl's time limit counts from when
+// the batch was read, and setCrawlTimeLimit() caps it for every request, so one huge
+// crawl can't keep the other clients waiting for long. Client sockets are non-blocking:
+// answers go into the client's outbox and are sent as the client reads them, and a client
+// that stops reading only holds up itself (we stop reading its requests once MAX_OUTBOX
+// bytes are waiting).
+
+#ifndef INTELWEBSERVER_H_
+#define INTELWEBSERVER_H_
+
+#include "IntelWeb.h"
+#include <chrono>
+#include <csignal>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class IntelWebServer
+{
+public:
+	IntelWebServer();
+	~IntelWebServer();
+	bool addStore(const std::string& name, const std::string& filePrefix);
+	bool listen(const std::string& socketPath);
+	void setCrawlTimeLimit(unsigned int milliseconds);
+	bool serve();
+	void stop();
+	void close();
+
+private:
+	struct Connection
+	{
+		int fd;
+		std::string inbox; // bytes received but not yet part of a complete frame
+		std::string outbox; // answer frames not yet sent, from outboxSent on
+		size_t outboxSent;
+	};
+
+	std::map<std::string, std::unique_ptr<IntelWeb> > m_stores;
+	std::vector<Connection> m_clients;
+	std::string m_socketPath;
+	int m_listenFd;
+	unsigned int m_crawlTimeLimit; // milliseconds, 0 for none
+	volatile std::sig_atomic_t m_running;
+
+private:
+	void handleBatch(const std::vector<std::pair<size_t, std::string> >& requests);
+	static bool flushOutbox(Connection& c);
+	std::string handleRequest(const std::string& request, std::chrono::steady_clock::time_point received);
+};
+
+class IntelWebClient
+{
+public:
+	IntelWebClient();
+	~IntelWebClient();
+	bool connect(const std::string& socketPath);
+	void close();
+	bool crawl(const std::string& store, const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions,
+		unsigned int& count);
+	bool crawl(const std::string& store, const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		const CrawlOptions& options,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions,
+		unsigned int& count,
+		CrawlStop& stoppedBy);
+	bool search(const std::string& store, const std::string& entity,
+		std::vector<InteractionTuple>& interactions);
+	bool prevalence(const std::string& store, const std::string& entity, unsigned int& prevalence);
+
+private:
+	int m_fd;
+
+private:
+	bool call(const std::string& request, std::string& response);
+};
+
+#endif // INTELWEBSERVER_H_
@@ -0,0 +1,401 @@
+#include "OrderedIndex.h"
+#include <algorithm>
+#include <cstdio>
+using namespace std;
+
+OrderedIndex::OrderedIndex()
+	: m_markedDirty(false) {}
+
+OrderedIndex::~OrderedIndex()
+{
+	close();
+}
+
+bool OrderedIndex::createNew(const string& filename)
+{
+	close();
+	removeFiles(filename); // runs of an old index of the same name
+	unique_ptr<Run> run(new Run);
+	if (!run->bf.createNew(filename))
+		return false;
+	run->m_numRecords = 0;
+	m_filename = filename;
+	m_runs.push_back(move(run));
+	m_markedDirty = false;
+	return true;
+}
+
+bool OrderedIndex::openExisting(const string& filename)
+{
+	close();
+	if (ifstream(dirtyName(filename)))
+		return false;
+	for (size_t i = 0; ; ++i)
+	{
+		unique_ptr<Run> run(new Run);
+		if (!run->bf.openExisting(runName(filename, i)))
+		{
+			if (i == 0)
+				return false;
+			break; // no more runs
+		}
+		if (!loadFences(*run))
+		{
+			close();
+			return false;
+		}
+		m_runs.push_back(move(run));
+	}
+	m_filename = filename;
+	m_markedDirty = false;
+	return true;
+}
+
+void OrderedIndex::close()
+{
+	if (isOpen())
+		flush();
+	m_runs.clear(); // BinaryFile destructors close the files
+	m_pending.clear();
+}
+
+bool OrderedIndex::isOpen() const
+{
+	return !m_runs.empty();
+}
+
+void OrderedIndex::add(const string& entity)
+{
+	if (entity.size() > CHARLIMIT)
+		return;
+	if (!m_markedDirty)
+		markDirty(); // before the entity can reach the hash tables
+	m_pending.insert(make_pair("E" + entity, entity));
+	string domain = reversedDomain(entity);
+	if (!domain.empty())
+		m_pending.insert(make_pair("D" + domain, entity));
+	if (m_pending.size() >= MAX_PENDING_RECORDS)
+		flush();
+}
+
+bool OrderedIndex::flush()
+{
+	if (!isOpen())
+		return false;
+	if (m_pending.empty())
+		return markClean();
+
+	// Write the pending records as a new last run
+	string name = runName(m_filename, m_runs.size());
+	RunWriter writer;
+	bool written = writer.open(name + ".tmp");
+	for (set<pair<string, string> >::iterator it = m_pending.begin(); it != m_pending.end() && written; ++it)
+		written = writer.add(*it);
+	unique_ptr<Run> run(new Run);
+	if (!written || !writer.finish(*run) || rename((name + ".tmp").c_str(), name.c_str()) != 0)
+	{
+		remove((name + ".tmp").c_str());
+		return false;
+	}
+	m_runs.push_back(move(run));
+	m_pending.clear();
+
+	// Then restore the tiers
+	while (m_runs.size() > 1 && m_runs[m_runs.size() - 1]->m_numRecords * static_cast<BinaryFile::Offset>(RUN_MERGE_RATIO)
+		> m_runs[m_runs.size() - 2]->m_numRecords)
+		if (!mergeLastRuns())
+			return false;
+	return markClean();
+}
+
+void OrderedIndex::findByPrefix(const string& prefix, vector<string>& entities)
+{
+	entities.clear();
+	vector<pair<string, string> > records;
+	scan("E" + prefix, successor("E" + prefix), records);
+	for (size_t i = 0; i < records.size(); ++i)
+		entities.push_back(records[i].second);
+}
+
+void OrderedIndex::findByDomainSuffix(const string& suffix, vector<string>& entities)
+{
+	entities.clear();
+	if (suffix.empty() || suffix == ".")
+		return;
+	string domain = reversedDomain(suffix[0] == '.' ? suffix.substr(1) : suffix);
+	if (domain.empty())
+		domain = suffix; // a single label, eg. "com"
+
+	// Matches are the domain itself and its subdomains (domain + "." + anything),
+	// but the range also holds siblings such as domain + "-cdn", so filter those out.
+	string key = "D" + domain;
+	vector<pair<string, string> > records;
+	scan(key, successor(key + "."), records);
+	for (size_t i = 0; i < records.size(); ++i)
+		if (records[i].first.size() == key.size() || records[i].first[key.size()] == '.')
+			entities.push_back(records[i].second);
+}
+
+void OrderedIndex::findInRange(const string& first, const string& last, vector<string>& entities)
+{
+	entities.clear();
+	vector<pair<string, string> > records;
+	scan("E" + first, "E" + last, records);
+	for (size_t i = 0; i < records.size(); ++i)
+		entities.push_back(records[i].second);
+}
+
+string OrderedIndex::reversedDomain(const string& entity)
+{
+	// The host part is whatever follows an optional "scheme://", up to the first
+	// '/', ':', '?' or '#'. It names a domain if it has at least one dot.
+	size_t start = entity.find("://");
+	start = start == string::npos ? 0 : start + 3;
+	size_t end = entity.find_first_of("/:?#", start);
+	string host = entity.substr(start, end == string::npos ? string::npos : end - start);
+	if (host.find('.') == string::npos)
+		return "";
+
+	string reversed;
+	size_t labelEnd = host.size();
+	while (true)
+	{
+		size_t dot = host.rfind('.', labelEnd - 1);
+		size_t labelStart = dot == string::npos ? 0 : dot + 1;
+		reversed += host.substr(labelStart, labelEnd - labelStart);
+		if (dot == string::npos)
+			break;
+		reversed += '.';
+		labelEnd = dot;
+		if (labelEnd == 0) // leading dot
+			break;
+	}
+	return reversed;
+}
+
+
+/////////////////////////////////
+//	Helper Functions
+/////////////////////////////////
+
+void OrderedIndex::scan(const string& from, const string& to, vector<pair<string, string> >& records)
+{
+	for (size_t i = 0; i < m_runs.size(); ++i)
+		scanRun(*m_runs[i], from, to, records);
+
+	// Entities added since the last flush
+	set<pair<string, string> >::iterator it = m_pending.lower_bound(make_pair(from, string()));
+	for (; it != m_pending.end() && it->first < to; ++it)
+		records.push_back(*it);
+
+	// The same record may be in several runs
+	sort(records.begin(), records.end());
+	records.erase(unique(records.begin(), records.end()), records.end());
+}
+
+void OrderedIndex::scanRun(Run& run, const string& from, const string& to, vector<pair<string, string> >& records)
+{
+	// Start at the last block whose fence key is smaller than from; any
+	// earlier block only holds keys that are smaller still.
+	size_t fence = lower_bound(run.m_fences.begin(), run.m_fences.end(), from) - run.m_fences.begin();
+	BinaryFile::Offset nextRecord = fence == 0 ? 0 : (fence - 1) * FENCE_INTERVAL;
+	vector<Record> block;
+	bool done = false;
+	while (!done && nextRecord < run.m_numRecords && readBlock(run, nextRecord, block))
+	{
+		nextRecord += block.size();
+		for (size_t i = 0; i < block.size() && !done; ++i)
+		{
+			string key = block[i].key;
+			if (key >= to)
+				done = true;
+			else if (key >= from)
+				records.push_back(make_pair(key, string(block[i].entity)));
+		}
+	}
+}
+
+string OrderedIndex::successor(const string& prefix)
+{
+	// The smallest string greater than every string starting with prefix
+	string next = prefix;
+	while (!next.empty() && static_cast<unsigned char>(next[next.size() - 1]) == 0xFF)
+		next.erase(next.size() - 1);
+	if (!next.empty())
+		next[next.size() - 1]++;
+	return next;
+}
+
+string OrderedIndex::runName(const string& filename, size_t run)
+{
+	return run == 0 ? filename : filename + "." + to_string(run);
+}
+
+string OrderedIndex::dirtyName(const string& filename)
+{
+	return filename + ".dirty";
+}
+
+bool OrderedIndex::markDirty()
+{
+	m_markedDirty = static_cast<bool>(ofstream(dirtyName(m_filename)))
+		&& BinaryFile::syncDirectoryOf(m_filename);
+	return m_markedDirty;
+}
+
+bool OrderedIndex::markClean()
+{
+	if (!m_markedDirty)
+		return true;
+
+	// The new runs' names have to be on disk before the dirty file is gone
+	if (!BinaryFile::syncDirectoryOf(m_filename) || remove(dirtyName(m_filename).c_str()) != 0)
+		return false;
+	m_markedDirty = false;
+	return BinaryFile::syncDirectoryOf(m_filename);
+}
+
+void OrderedIndex::removeFiles(const string& filename)
+{
+	remove(dirtyName(filename).c_str());
+	remove(filename.c_str());
+	for (size_t i = 1; remove(runName(filename, i).c_str()) == 0; ++i)
+		;
+}
+
+bool OrderedIndex::mergeLastRuns()
+{
+	// Merge the last run into the one before it, writing the result beside that
+	// run and renaming it over. (A crash before the last run's file is deleted
+	// just leaves its records in two runs, which lookups don't mind.)
+	size_t last = m_runs.size() - 1;
+	Run& older = *m_runs[last - 1];
+	Run& newer = *m_runs[last];
+	string name = runName(m_filename, last - 1);
+	RunWriter writer;
+	bool written = writer.open(name + ".tmp");
+
+	vector<Record> olderBlock, newerBlock;
+	BinaryFile::Offset olderNext = 0, newerNext = 0;
+	size_t olderPos = 0, newerPos = 0;
+	while (written)
+	{
+		// Refill either block when it runs out
+		if (olderPos == olderBlock.size() && olderNext < older.m_numRecords)
+		{
+			written = readBlock(older, olderNext, olderBlock);
+			olderNext += olderBlock.size();
+			olderPos = 0;
+		}
+		if (newerPos == newerBlock.size() && newerNext < newer.m_numRecords)
+		{
+			written = written && readBlock(newer, newerNext, newerBlock);
+			newerNext += newerBlock.size();
+			newerPos = 0;
+		}
+		if (!written)
+			break;
+
+		// Take the smaller of the two next records
+		bool haveOlder = olderPos < olderBlock.size(), haveNewer = newerPos < newerBlock.size();
+		if (!haveOlder && !haveNewer)
+			break;
+		pair<string, string> o, n;
+		if (haveOlder)
+			o = make_pair(string(olderBlock[olderPos].key), string(olderBlock[olderPos].entity));
+		if (haveNewer)
+			n = make_pair(string(newerBlock[newerPos].key), string(newerBlock[newerPos].entity));
+		if (haveOlder && (!haveNewer || o < n))
+		{
+			written = writer.add(o);
+			olderPos++;
+		}
+		else
+		{
+			written = writer.add(n);
+			newerPos++;
+		}
+	}
+
+	// Swap the merged run in
+	unique_ptr<Run> merged(new Run);
+	if (!written || !writer.finish(*merged) || rename((name + ".tmp").c_str(), name.c_str()) != 0)
+	{
+		remove((name + ".tmp").c_str());
+		return false;
+	}
+	remove(runName(m_filename, last).c_str());
+	m_runs.pop_back();
+	m_runs.back() = move(merged);
+	return true;
+}
+
+bool OrderedIndex::readBlock(Run& run, BinaryFile::Offset firstRecord, vector<Record>& block)
+{
+	BinaryFile::Offset count = min<BinaryFile::Offset>(FENCE_INTERVAL, run.m_numRecords - firstRecord);
+	block.resize(count);
+	return run.bf.read(reinterpret_cast<char*>(block.data()), count * sizeof(Record), firstRecord * sizeof(Record));
+}
+
+bool OrderedIndex::loadFences(Run& run)
+{
+	run.m_fences.clear();
+	BinaryFile::Offset length = run.bf.fileLength();
+	if (length < 0 || length % sizeof(Record) != 0)
+		return false;
+	run.m_numRecords = length / sizeof(Record);
+
+	Record r;
+	for (BinaryFile::Offset i = 0; i < run.m_numRecords; i += FENCE_INTERVAL)
+	{
+		if (!run.bf.read(r, i * sizeof(Record)))
+			return false;
+		run.m_fences.push_back(r.key);
+	}
+	return true;
+}
+
+
+/////////////////////////////////
+//	RunWriter
+/////////////////////////////////
+
+bool OrderedIndex::RunWriter::open(const string& filename)
+{
+	m_filename = filename;
+	m_numRecords = 0;
+	m_fences.clear();
+	m_ok = bf.createNew(filename);
+	return m_ok;
+}
+
+bool OrderedIndex::RunWriter::add(const pair<string, string>& record)
+{
+	if (!m_ok)
+		return false;
+	if (m_numRecords > 0 && record == m_last)
+		return true;
+
+	Record r;
+	memset(&r, 0, sizeof(r));
+	strcpy(r.key, record.first.c_str());
+	strcpy(r.entity, record.second.c_str());
+	m_ok = bf.write(r, m_numRecords * sizeof(Record));
+	if (m_numRecords % FENCE_INTERVAL == 0)
+		m_fences.push_back(record.first);
+	m_numRecords++;
+	m_last = record;
+	return m_ok;
+}
+
+bool OrderedIndex::RunWriter::finish(Run& run)
+{
+	// Reopen the file for reading; it stays open when the caller renames it
+	m_ok = m_ok && bf.sync();
+	bf.close();
+	if (!m_ok)
+		return false;
+	run.m_numRecords = m_numRecords;
+	run.m_fences.swap(m_fences);
+	return run.bf.openExisting(m_filename);
+}
@@ -0,0 +1,113 @@
+// OrderedIndex is an optional disk-based ordered index of every entity IntelWeb has
+// ingested, kept beside the forward and reverse DiskMultiMaps so that entities can be
+// found by prefix (eg. every file whose name starts with "setup_") or by domain suffix
+// (eg. every website under evil-cdn.net) without scanning the hash tables.
+//
+// The index is a few sorted runs of fixed-size Records, each in its own file (filename for
+// run 0, filename.1, filename.2 and so on for the others). Every entity gets an
+// "E" record keyed by the entity itself, and an entity that names a domain (a website,
+// or anything else whose host part contains a dot) also gets a "D" record keyed by the
+// domain with its labels reversed, so "http://www.evil-cdn.net/x" is filed under
+// "net.evil-cdn.www" and all of evil-cdn.net sits in one contiguous range of every run. In
+// memory we only keep a sparse fence index per run: the key of every FENCE_INTERVAL-th
+// record, which is enough to binary search to the right block of the run and read forward
+// from there. Lookups search every run.
+//
+// add() only buffers new entities (lookups still see them); flush() writes them out as a
+// new, last run, as does add() once MAX_PENDING_RECORDS records are waiting. Runs are
+// kept in tiers, each at least RUN_MERGE_RATIO times the size of the next: whenever the
+// last run gets too big for that, it is merged into the one before (by writing a new
+// sorted file and renaming it over the old one). So flushing a small batch of entities
+// is cheap however big the index is, and every record is only rewritten a logarithmic
+// number of times. Entities are never removed (purge() leaves them behind), so IntelWeb
+// checks that the entities it finds still exist.
+//
+// While there are buffered entities the index is marked dirty by a filename.dirty file,
+// created (and waited for) before the first of them can reach the hash tables and deleted
+// once flush() has written them. openExisting() refuses a dirty index, eg. one left behind
+// by a crash, since entities that are in the hash tables may be missing from it.
+
+#ifndef ORDEREDINDEX_H_
+#define ORDEREDINDEX_H_
+
+#include "DiskMultiMap.h"
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Global Variables
+const unsigned int FENCE_INTERVAL = 64;
+const unsigned int RUN_MERGE_RATIO = 2;
+const unsigned int MAX_PENDING_RECORDS = 1 << 16;
+
+class OrderedIndex
+{
+public:
+	OrderedIndex();
+	~OrderedIndex();
+	bool createNew(const std::string& filename);
+	bool openExisting(const std::string& filename);
+	void close();
+	bool isOpen() const;
+	void add(const std::string& entity);
+	bool flush();
+	void findByPrefix(const std::string& prefix, std::vector<std::string>& entities);
+	void findByDomainSuffix(const std::string& suffix, std::vector<std::string>& entities);
+	void findInRange(const std::string& first, const std::string& last, std::vector<std::string>& entities);
+	static std::string reversedDomain(const std::string& entity);
+	static void removeFiles(const std::string& filename);
+
+private:
+	struct Record
+	{
+		char key[CHARLIMIT + 2]; // 'E' or 'D', then the entity or reversed domain
+		char entity[CHARLIMIT + 1];
+	};
+
+	struct Run
+	{
+		BinaryFile	bf;
+		BinaryFile::Offset	m_numRecords;
+		std::vector<std::string> m_fences;
+	};
+
+	// Writes a new run file, dropping duplicate records and building its fences
+	class RunWriter
+	{
+	public:
+		bool open(const std::string& filename);
+		bool add(const std::pair<std::string, std::string>& record);
+		bool finish(Run& run);
+
+	private:
+		BinaryFile	bf;
+		std::string	m_filename;
+		BinaryFile::Offset	m_numRecords;
+		std::vector<std::string> m_fences;
+		std::pair<std::string, std::string> m_last;
+		bool		m_ok;
+	};
+
+	std::string	m_filename;
+	std::vector<std::unique_ptr<Run> > m_runs; // biggest first
+	std::set<std::pair<std::string, std::string> > m_pending; // (key, entity) not yet flushed
+	bool		m_markedDirty; // the dirty file exists
+
+private:
+	void scan(const std::string& from, const std::string& to,
+		std::vector<std::pair<std::string, std::string> >& records);
+	static void scanRun(Run& run, const std::string& from, const std::string& to,
+		std::vector<std::pair<std::string, std::string> >& records);
+	static std::string successor(const std::string& prefix);
+	static std::string runName(const std::string& filename, size_t run);
+	static std::string dirtyName(const std::string& filename);
+	bool markDirty();
+	bool markClean();
+	bool mergeLastRuns();
+	static bool readBlock(Run& run, BinaryFile::Offset firstRecord, std::vector<Record>& block);
+	static bool loadFences(Run& run);
+};
+
+#endif // ORDEREDINDEX_H_
@@ -0,0 +1,291 @@
+#include "PartitionedIntelWeb.h"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+PartitionedIntelWeb::PartitionedIntelWeb()
+	: m_fileOpen(false), m_maxDataItems(0), m_numShards(1) {}
+
+PartitionedIntelWeb::~PartitionedIntelWeb()
+{
+	close();
+}
+
+bool PartitionedIntelWeb::createNew(const string& filePrefix, unsigned int maxDataItemsPerPartition,
+	unsigned int numShards)
+{
+	close();
+	if (numShards == 0)
+		return false;
+	m_filePrefix = filePrefix;
+	m_maxDataItems = maxDataItemsPerPartition;
+	m_numShards = numShards;
+	if (!writeManifest())
+		return false;
+	m_fileOpen = true;
+	return true;
+}
+
+bool PartitionedIntelWeb::openExisting(const string& filePrefix)
+{
+	close();
+	ifstream manifest(filePrefix + "_partitions.txt");
+	if (!manifest || !(manifest >> m_maxDataItems >> m_numShards) || m_numShards == 0)
+		return false;
+	m_filePrefix = filePrefix;
+
+	string partition;
+	getline(manifest, partition); // rest of the first line
+	while (getline(manifest, partition))
+	{
+		if (partition.empty())
+			continue;
+		unique_ptr<IntelWeb> web(new IntelWeb);
+		if (!web->openExisting(partitionPrefix(partition)))
+		{
+			close();
+			return false;
+		}
+		m_partitions[partition] = move(web);
+	}
+	m_fileOpen = true;
+	return true;
+}
+
+void PartitionedIntelWeb::close()
+{
+	m_partitions.clear(); // IntelWeb destructors close the files
+	m_fileOpen = false;
+}
+
+bool PartitionedIntelWeb::addPartition(const string& partition)
+{
+	if (!m_fileOpen || partition.empty() || partition.find_first_of("/\\\r\n") != string::npos)
+		return false;
+	if (m_partitions.count(partition))
+		return true;
+
+	unique_ptr<IntelWeb> web(new IntelWeb);
+	if (!web->createNew(partitionPrefix(partition), m_maxDataItems, m_numShards))
+		return false;
+	m_partitions[partition] = move(web);
+	if (!writeManifest())
+	{
+		m_partitions.erase(partition);
+		IntelWeb::removeStore(partitionPrefix(partition));
+		return false;
+	}
+	return true;
+}
+
+bool PartitionedIntelWeb::dropPartition(const string& partition)
+{
+	if (!m_fileOpen || !m_partitions.count(partition))
+		return false;
+
+	// Take the partition out of the manifest before deleting its files, so a
+	// crash in between leaves stray files behind rather than a broken manifest.
+	m_partitions.erase(partition);
+	if (!writeManifest())
+		return false;
+	return IntelWeb::removeStore(partitionPrefix(partition));
+}
+
+vector<string> PartitionedIntelWeb::partitions() const
+{
+	vector<string> names;
+	for (map<string, unique_ptr<IntelWeb> >::const_iterator it = m_partitions.begin(); it != m_partitions.end(); ++it)
+		names.push_back(it->first);
+	return names;
+}
+
+bool PartitionedIntelWeb::ingest(const string& partition, const vector<string>& telemetryFiles)
+{
+	if (!addPartition(partition))
+		return false;
+	return m_partitions[partition]->ingest(telemetryFiles);
+}
+
+unsigned int PartitionedIntelWeb::crawl(const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions)
+{
+	if (m_partitions.empty())
+	{
+		badEntitiesFound.clear();
+		badInteractions.clear();
+		return 0;
+	}
+	return crawl(indicators, minPrevalenceToBeGood, m_partitions.begin()->first,
+		m_partitions.rbegin()->first, badEntitiesFound, badInteractions);
+}
+
+unsigned int PartitionedIntelWeb::crawl(const vector<string>& indicators,
+	unsigned int minPrevalenceToBeGood,
+	const string& firstPartition, const string& lastPartition,
+	vector<string>& badEntitiesFound,
+	vector<InteractionTuple>& badInteractions)
+{
+	badEntitiesFound.clear();
+	badInteractions.clear();
+	if (!m_fileOpen)
+		return 0;
+
+	vector<IntelWeb*> selected;
+	for (map<string, unique_ptr<IntelWeb> >::iterator it = m_partitions.lower_bound(firstPartition);
+		it != m_partitions.end() && it->first <= lastPartition; ++it)
+		selected.push_back(it->second.get());
+	if (selected.empty())
+		return 0;
+
+	set<string> badEntitiesSet;
+	set<InteractionTuple> badInteractionsSet;
+
+	// Every entity is queued at most once: an entity's prevalence doesn't change
+	// during the crawl, so neither does the decision to queue it.
+	set<string> queued(indicators.begin(), indicators.end());
+	vector<string> wave(queued.begin(), queued.end());
+	unsigned int count = 0;
+	while (!wave.empty())
+	{
+		// Look up the whole wave in every partition at once
+		vector<vector<vector<InteractionTuple> > > found(selected.size());
+		forEachPartition(selected.size(), bind(&PartitionedIntelWeb::searchPartition,
+			cref(selected), cref(wave), ref(found), placeholders::_1));
+
+		// An entity is bad if any partition has seen it; its neighbours are
+		// candidates for the next wave.
+		vector<string> candidates;
+		for (size_t i = 0; i < wave.size(); ++i)
+		{
+			bool isBad = false;
+			for (size_t p = 0; p < selected.size(); ++p)
+			{
+				const vector<InteractionTuple>& interactions = found[p][i];
+				for (size_t j = 0; j < interactions.size(); ++j)
+				{
+					isBad = true;
+					badInteractionsSet.insert(interactions[j]);
+					const string& other = interactions[j].from == wave[i] ? interactions[j].to : interactions[j].from;
+					if (queued.insert(other).second)
+						candidates.push_back(other);
+				}
+			}
+			if (isBad && badEntitiesSet.insert(wave[i]).second)
+				count++;
+		}
+
+		// A candidate is queued if its prevalence summed over the partitions is under
+		// the threshold. Each partition counts up to the threshold at most, which is
+		// enough to tell.
+		vector<vector<unsigned int> > prevalences(selected.size());
+		forEachPartition(selected.size(), bind(&PartitionedIntelWeb::countPartition,
+			cref(selected), cref(candidates), minPrevalenceToBeGood, ref(prevalences), placeholders::_1));
+
+		wave.clear();
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			unsigned long long total = 0;
+			for (size_t p = 0; p < selected.size(); ++p)
+				total += prevalences[p][i];
+			if (total < minPrevalenceToBeGood)
+				wave.push_back(candidates[i]);
+		}
+	}
+
+	// Copy over the ordered entities/interactions into the vectors
+	badEntitiesFound.assign(badEntitiesSet.begin(), badEntitiesSet.end());
+	badInteractions.assign(badInteractionsSet.begin(), badInteractionsSet.end());
+	return count;
+}
+
+bool PartitionedIntelWeb::purge(const string& entity)
+{
+	if (!m_fileOpen)
+		return false;
+
+	bool purged = false;
+	for (map<string, unique_ptr<IntelWeb> >::iterator it = m_partitions.begin(); it != m_partitions.end(); ++it)
+		purged = it->second->purge(entity) || purged;
+	return purged;
+}
+
+
+/////////////////////////////////
+//	Helper Functions
+/////////////////////////////////
+
+string PartitionedIntelWeb::partitionPrefix(const string& partition) const
+{
+	return m_filePrefix + "_" + partition;
+}
+
+bool PartitionedIntelWeb::writeManifest()
+{
+	// Write the new manifest beside the old one, wait for it to reach the disk and
+	// rename it over, so the manifest on disk is always complete.
+	string manifestName = m_filePrefix + "_partitions.txt";
+	string tempName = manifestName + ".tmp";
+	ostringstream manifest;
+	manifest << m_maxDataItems << ' ' << m_numShards << '\n';
+	for (map<string, unique_ptr<IntelWeb> >::iterator it = m_partitions.begin(); it != m_partitions.end(); ++it)
+		manifest << it->first << '\n';
+	string contents = manifest.str();
+
+	BinaryFile bf;
+	bool written = bf.createNew(tempName) && bf.write(contents.data(), contents.size(), 0) && bf.sync();
+	bf.close();
+	if (!written || rename(tempName.c_str(), manifestName.c_str()) != 0)
+	{
+		remove(tempName.c_str());
+		return false;
+	}
+	return BinaryFile::syncDirectoryOf(manifestName);
+}
+
+void PartitionedIntelWeb::forEachPartition(size_t numPartitions, const function<void(size_t)>& work)
+{
+	// No more threads than the machine can run at once, each taking the next
+	// partition nobody has started on until there are none left
+	unsigned int numThreads = thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+	if (numThreads > numPartitions)
+		numThreads = static_cast<unsigned int>(numPartitions);
+
+	atomic<size_t> next(0);
+	vector<thread> workers;
+	for (unsigned int i = 1; i < numThreads; ++i)
+		workers.push_back(thread(&PartitionedIntelWeb::partitionWorker, numPartitions, cref(work), ref(next)));
+	partitionWorker(numPartitions, work, next); // this thread is one of the workers
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void PartitionedIntelWeb::partitionWorker(size_t numPartitions, const function<void(size_t)>& work,
+	atomic<size_t>& next)
+{
+	for (size_t p = next++; p < numPartitions; p = next++)
+		work(p);
+}
+
+void PartitionedIntelWeb::searchPartition(const vector<IntelWeb*>& webs, const vector<string>& entities,
+	vector<vector<vector<InteractionTuple> > >& found, size_t p)
+{
+	found[p].resize(entities.size());
+	for (size_t i = 0; i < entities.size(); ++i)
+		webs[p]->search(entities[i], found[p][i]);
+}
+
+void PartitionedIntelWeb::countPartition(const vector<IntelWeb*>& webs, const vector<string>& entities,
+	unsigned int cap, vector<vector<unsigned int> >& prevalences, size_t p)
+{
+	prevalences[p].resize(entities.size());
+	for (size_t i = 0; i < entities.size(); ++i)
+		prevalences[p][i] = webs[p]->prevalence(entities[i], cap);
+}
@@ -0,0 +1,70 @@
+// PartitionedIntelWeb splits telemetry by time into partitions (eg. one per day, named
+// "2016-03-14"), each of which is an ordinary IntelWeb store with the file prefix
+// filePrefix_partitionName. A manifest file, filePrefix_partitions.txt, lists the size
+// every partition is created with followed by the names of the partitions.
+//
+// Retiring old telemetry is a matter of dropPartition(), which just deletes that
+// partition's files, instead of a purge() per entity or a full rebuild.
+//
+// crawl() - works exactly like IntelWeb::crawl() on the union of the selected partitions
+//     (all of them, or those whose names fall in [firstPartition, lastPartition], eg. the
+//     last 7 days): an entity's prevalence is the sum of its prevalence in every selected
+//     partition. The crawl runs one wave of the queue at a time, and within a wave the
+//     partitions do their lookups in parallel, on up to hardware_concurrency() threads that
+//     each take the next partition not yet looked at.
+
+#ifndef PARTITIONEDINTELWEB_H_
+#define PARTITIONEDINTELWEB_H_
+
+#include "IntelWeb.h"
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class PartitionedIntelWeb
+{
+public:
+	PartitionedIntelWeb();
+	~PartitionedIntelWeb();
+	bool createNew(const std::string& filePrefix, unsigned int maxDataItemsPerPartition,
+		unsigned int numShards = 1);
+	bool openExisting(const std::string& filePrefix);
+	void close();
+	bool addPartition(const std::string& partition);
+	bool dropPartition(const std::string& partition);
+	std::vector<std::string> partitions() const;
+	bool ingest(const std::string& partition, const std::vector<std::string>& telemetryFiles);
+	unsigned int crawl(const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions);
+	unsigned int crawl(const std::vector<std::string>& indicators,
+		unsigned int minPrevalenceToBeGood,
+		const std::string& firstPartition, const std::string& lastPartition,
+		std::vector<std::string>& badEntitiesFound,
+		std::vector<InteractionTuple>& badInteractions);
+	bool purge(const std::string& entity);
+
+private:
+	bool m_fileOpen;
+	std::string m_filePrefix;
+	unsigned int m_maxDataItems;
+	unsigned int m_numShards;
+	std::map<std::string, std::unique_ptr<IntelWeb> > m_partitions;
+
+private:
+	std::string partitionPrefix(const std::string& partition) const;
+	bool writeManifest();
+	static void forEachPartition(size_t numPartitions, const std::function<void(size_t)>& work);
+	static void partitionWorker(size_t numPartitions, const std::function<void(size_t)>& work,
+		std::atomic<size_t>& next);
+	static void searchPartition(const std::vector<IntelWeb*>& webs, const std::vector<std::string>& entities,
+		std::vector<std::vector<std::vector<InteractionTuple> > >& found, size_t p);
+	static void countPartition(const std::vector<IntelWeb*>& webs, const std::vector<std::string>& entities,
+		unsigned int cap, std::vector<std::vector<unsigned int> >& prevalences, size_t p);
+};
+
+#endif // PARTITIONEDINTELWEB_H_